@@ -4,6 +4,21 @@
 extern struct Super *super;		// superblock
 extern uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+struct BcStats bc_stats = { .bc_cap = BC_DEFAULT_CAP };
+
+// Next block the eviction clock looks at
+static uint32_t bc_hand;
+
+// One bit per disk block, set while the cached block holds changes not
+// yet on disk.  Clean blocks are mapped read-only, so the first write to
+// one faults and bc_pgfault sets its bit; writing a block back maps it
+// read-only again.  Sync then visits only the words with bits set.
+static uint32_t bc_dirty[DISKSIZE / BLKSIZE / 32];
+static uint32_t bc_ndirty;
+
+// The run of dirty blocks bc_flush_add has queued for writing
+static uint32_t flush_start, flush_len;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,11 +39,184 @@ va_is_mapped(void *va)
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	uint32_t blockno = ((uint32_t)va - DISKMAP) / BLKSIZE;
+
+	return (bc_dirty[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+static void
+bc_set_dirty(uint32_t blockno)
+{
+	bc_dirty[blockno / 32] |= 1 << (blockno % 32);
+	bc_ndirty++;
+}
+
+// Drop the block at va from the cache.  It must not be dirty.
+static void
+bc_unmap(void *va)
+{
+	int r;
+
+	assert(!va_is_dirty(va));
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("bc_unmap: sys_page_unmap: %e", r);
+	bc_stats.bc_cached--;
+}
+
+// Evict one block, chosen by the CLOCK algorithm: the hand sweeps over
+// the cached blocks, giving each block whose accessed bit is set a
+// second chance by clearing the bit, and evicts the first block it finds
+// with the bit clear, writing it back first if it is dirty.
+// The superblock and the bitmap stay cached, since bc_pgfault uses
+// them, and so do blocks that clients have mapped.
+// Returns true if it evicted a block.
+static bool
+bc_evict(void)
+{
+	uint32_t n, blockno, npinned;
+	void *va;
+	pte_t pte;
+	int r;
+
+	if (super == NULL)
+		return false;
+	npinned = 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	// Two sweeps are enough to clear every accessed bit and come back.
+	for (n = 0; n < 2 * super->s_nblocks; n++) {
+		blockno = bc_hand;
+		if (++bc_hand >= super->s_nblocks)
+			bc_hand = 0;
+		va = (void *) (DISKMAP + blockno * BLKSIZE);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			// Skip the whole page table at once.
+			bc_hand = ROUNDUP(blockno + 1, NPTENTRIES);
+			if (bc_hand >= super->s_nblocks)
+				bc_hand = 0;
+			continue;
+		}
+		pte = uvpt[PGNUM(va)];
+		if (!(pte & PTE_P) || blockno < npinned || pageref(va) > 1)
+			continue;
+		if (pte & PTE_A) {
+			if ((r = sys_page_map(0, va, 0, va, pte & PTE_SYSCALL)) < 0)
+				panic("bc_evict: sys_page_map: %e", r);
+			continue;
+		}
+		if (va_is_dirty(va)) {
+			flush_block(va);
+			bc_stats.bc_writebacks++;
+		}
+		bc_unmap(va);
+		bc_stats.bc_evictions++;
+		return true;
+	}
+	return false;
+}
+
+// Set the most blocks the cache holds, evicting blocks now if it holds
+// more than that.
+void
+bc_set_cap(uint32_t cap)
+{
+	bc_stats.bc_cap = MAX(cap, BC_MIN_CAP);
+	while (bc_stats.bc_cached > bc_stats.bc_cap && bc_evict())
+		/* do nothing */;
+}
+
+// Read the n disk blocks starting at blockno, none of which may be
+// cached, into the cache with a single disk request.  The disk fills
+// pages in this thread's staging area, and other threads run until it
+// is done; the blocks are then mapped into the cache, read-only since
+// they are clean.  A block that became cached while we waited, by a
+// fault or because it was allocated again, keeps that page instead.
+// Returns the number of blocks it added to the cache.
+static uint32_t
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+	struct PageBatch batch;
+	struct ide_req req;
+	char *stage = (char *) BC_STAGE + (thread_self() + 1) * BC_RUN_MAX * BLKSIZE;
+	uint32_t i, nmapped = 0;
+	int r;
+
+	assert(n > 0 && n <= BC_RUN_MAX);
+	while (bc_stats.bc_cached + n > bc_stats.bc_cap && bc_evict())
+		/* do nothing */;
+
+	pagebatch_init(&batch, 0, 0);
+	for (i = 0; i < n; i++)
+		if ((r = pagebatch_add(&batch, PAGEOP_ALLOC, NULL, stage + i * BLKSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_read_run: sys_page_batch: %e", r);
+	if ((r = pagebatch_flush(&batch)) < 0)
+		panic("bc_read_run: sys_page_batch: %e", r);
+
+	req.r_secno = blockno * BLKSECTS;
+	req.r_buf = stage;
+	req.r_nsecs = n * BLKSECTS;
+	req.r_write = false;
+	ide_submit(&req);
+	if ((r = thread_wait_io(&req)) < 0)
+		panic("bc_read_run: ide read: %e", r);
+
+	for (i = 0; i < n; i++) {
+		if (!va_is_mapped(diskaddr(blockno + i))) {
+			if ((r = pagebatch_add(&batch, PAGEOP_MAP, stage + i * BLKSIZE, diskaddr(blockno + i), PTE_P|PTE_U)) < 0)
+				panic("bc_read_run: sys_page_batch: %e", r);
+			nmapped++;
+		}
+		if ((r = pagebatch_add(&batch, PAGEOP_UNMAP, NULL, stage + i * BLKSIZE, 0)) < 0)
+			panic("bc_read_run: sys_page_batch: %e", r);
+	}
+	if ((r = pagebatch_flush(&batch)) < 0)
+		panic("bc_read_run: sys_page_batch: %e", r);
+	bc_stats.bc_cached += nmapped;
+	return nmapped;
+}
+
+// Read the n disk blocks starting at blockno, none of which may be
+// cached, into the cache ahead of their use.
+void
+bc_prefetch(uint32_t blockno, uint32_t n)
+{
+	bc_stats.bc_readahead += bc_read_run(blockno, n);
+}
+
+// Bring the block at addr into the cache if it is not there, as a
+// fault would, but letting other threads run while the disk reads it.
+void
+bc_fetch(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	if (va_is_mapped(addr))
+		return;
+	bc_stats.bc_misses += bc_read_run(blockno, 1);
+}
+
+// Give newly allocated block blockno a zero-filled, dirty page in the
+// cache, without reading its old contents from disk.
+void
+bc_new_block(uint32_t blockno)
+{
+	void *addr = diskaddr(blockno);
+	int r;
+
+	if (va_is_mapped(addr)) {
+		memset(addr, 0, BLKSIZE);
+		return;
+	}
+	if (bc_stats.bc_cached >= bc_stats.bc_cap)
+		bc_evict();
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_new_block: sys_page_alloc: %e", r);
+	bc_stats.bc_cached++;
+	bc_set_dirty(blockno);
 }
 
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, evicting another block first if the
+// cache is full.  A write to a clean block faults too; mark the
+// block dirty and let the write through.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
@@ -54,15 +242,31 @@ bc_pgfault(struct UTrapframe *utf)
 	// NOTE: 此函数在fs env发生缺页中断时执行, 需要根据缺页产生的地址, 读取硬盘上的数据
 
 	addr = ROUNDDOWN(addr, PGSIZE);
+	// NOTE: 干净的块只读映射, 第一次写的时候在这里记为脏块
+	if((utf->utf_err & FEC_WR) && va_is_mapped(addr)) {
+		bc_set_dirty(blockno);
+		if((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		return;
+	}
+
+	// NOTE: 缓存已满时先用CLOCK算法换出一个块; 全部块都换不出时允许暂时超出上限
+	if(bc_stats.bc_cached >= bc_stats.bc_cap)
+		bc_evict();
 	if((r = sys_page_alloc(thisenv->env_id, addr, PTE_P|PTE_U|PTE_W)) < 0)
 		panic("Failed to call sys_page_alloc at address [%08x] with error %e", addr, r);
 
+	bc_stats.bc_cached++;
+	bc_stats.bc_misses++;
+
 	// 读取的单位是扇区, 扇区编号从0开始, 采用的是LSB的方式
 	ide_read(blockno * 8, addr, 8);
 
-	// Clear the dirty bit for the disk block page since we just read the
-	// block from disk
-	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
+	// The block is clean since we just read it from disk: map it
+	// read-only, unless this fault is a write to it.
+	if (utf->utf_err & FEC_WR)
+		bc_set_dirty(blockno);
+	if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U | ((utf->utf_err & FEC_WR) ? PTE_W : 0))) < 0)
 		panic("in bc_pgfault, sys_page_map: %e", r);
 
 	// Check that the block we read was allocated. (exercise for
@@ -72,37 +276,84 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
-// Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
-// If the block is not in the block cache or is not dirty, does
-// nothing.
-// Hint: Use va_is_mapped, va_is_dirty, and ide_write.
-// Hint: Use the PTE_SYSCALL constant when calling sys_page_map.
-// Hint: Don't forget to round addr down.
+// Write the run of blocks queued by bc_flush_add with one disk
+// request, and map them read-only again so that the next write to
+// each marks it dirty.
 void
-flush_block(void *addr)
+bc_flush_done(void)
 {
-	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	struct PageBatch batch;
+	uint32_t i, b;
+	int r;
 
-	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
-		panic("flush_block of bad va %08x", addr);
+	if (flush_len == 0)
+		return;
+	if ((r = ide_write(flush_start * BLKSECTS, diskaddr(flush_start), flush_len * BLKSECTS)) < 0)
+		panic("bc_flush_done: ide_write: %e", r);
+
+	pagebatch_init(&batch, 0, 0);
+	for (i = 0; i < flush_len; i++) {
+		b = flush_start + i;
+		bc_dirty[b / 32] &= ~(1 << (b % 32));
+		bc_ndirty--;
+		if ((r = pagebatch_add(&batch, PAGEOP_MAP, diskaddr(b), diskaddr(b), PTE_P|PTE_U)) < 0)
+			panic("bc_flush_done: sys_page_batch: %e", r);
+	}
+	if ((r = pagebatch_flush(&batch)) < 0)
+		panic("bc_flush_done: sys_page_batch: %e", r);
+	flush_len = 0;
+}
 
-	// LAB 5: Your code here.
-	// panic("flush_block not implemented");
-	// NOTE: 刷新内存页面缓存到硬盘, 页面必须满足1): 已经映射到虚拟地址空间, 2): 是脏页面
+// Queue the block containing addr for writing if it is dirty.  Dirty
+// blocks queued in disk order that are adjacent on disk go out in a
+// single request; call bc_flush_done to write the last run.
+void
+bc_flush_add(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
 
-	if(!va_is_mapped(addr) || !va_is_dirty(addr))
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("bc_flush_add of bad va %08x", addr);
+	if (!va_is_dirty(addr))
 		return;
+	if (flush_len > 0
+	    && (blockno != flush_start + flush_len || flush_len == BC_RUN_MAX)) {
+		bc_flush_done();
+		// Writing the run may have cleaned this block too.
+		if (!va_is_dirty(addr))
+			return;
+	}
+	if (flush_len++ == 0)
+		flush_start = blockno;
+}
 
-	// 开始写入脏页面到硬盘
-	addr = ROUNDDOWN(addr, PGSIZE);
-	ide_write(blockno * 8, addr, 8);
-
-	// 重新映射addr
-	int r = 0;
-	if((r = sys_page_map(0, addr, 0, addr, PTE_SYSCALL)) < 0)
-		panic("Failed to call sys_page_map in flush block at address [%08x] with error %e\n", addr, r);
+// Flush the contents of the block containing VA out to disk if
+// necessary, and map it read-only again.
+// If the block is not in the block cache or is not dirty, does
+// nothing.
+void
+flush_block(void *addr)
+{
+	// NOTE: 刷新内存页面缓存到硬盘, 只有脏块才需要写回
+	bc_flush_add(addr);
+	bc_flush_done();
+}
 
+// Write every dirty block to disk, visiting only the dirty bitmap words
+// with bits set, and merging adjacent dirty blocks into single writes.
+void
+bc_sync(void)
+{
+	uint32_t w, b;
+
+	for (w = 0; bc_ndirty > 0 && w < ARRAY_SIZE(bc_dirty); w++) {
+		if (bc_dirty[w] == 0)
+			continue;
+		for (b = w * 32; b < w * 32 + 32; b++)
+			if (bc_dirty[w] & (1 << (b % 32)))
+				bc_flush_add(diskaddr(b));
+	}
+	bc_flush_done();
 }
 
 // Test that the block cache works, by smashing the superblock and
@@ -122,7 +373,7 @@ check_bc(void)
 	assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	bc_unmap(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
@@ -150,7 +401,7 @@ check_bc(void)
 	//assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
-	sys_page_unmap(0, diskaddr(1));
+	bc_unmap(diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
 	// read it back in
@@ -0,0 +1,93 @@
+/*
+ * Directory entry cache.  Remembers what dir_lookup found for recently
+ * looked up (directory, name) pairs, including names that were not
+ * there, so that walking a path the server has seen before does not
+ * search each directory along it again.
+ *
+ * Directories and files are named by their struct File, which stays at
+ * the same address in the block cache region for as long as it exists.
+ * The cache is direct mapped: a new entry replaces whatever was in its
+ * slot.
+ */
+
+#include "fs.h"
+
+#define NDENTRY		512
+
+struct Dentry {
+	struct File *d_dir;		// null if the slot is empty
+	struct File *d_file;		// null if the name is not in d_dir
+	uint32_t d_hash;		// dir_hash(d_name)
+	char d_name[MAXNAMELEN];
+};
+
+static struct Dentry dcache[NDENTRY];
+struct DcStats dc_stats;
+
+static struct Dentry *
+dcache_slot(struct File *dir, uint32_t hash)
+{
+	// File structures are 256-byte aligned; drop the bits that are
+	// always zero.
+	return &dcache[(hash ^ ((uintptr_t) dir >> 8)) % NDENTRY];
+}
+
+// If the cache knows whether name is in dir, set *pf to the file, or
+// to null if there is no such file, and return true.
+bool
+dcache_lookup(struct File *dir, const char *name, struct File **pf)
+{
+	uint32_t hash = dir_hash(name);
+	struct Dentry *d = dcache_slot(dir, hash);
+
+	if (d->d_dir != dir || d->d_hash != hash || strcmp(d->d_name, name) != 0) {
+		dc_stats.dc_misses++;
+		return false;
+	}
+	dc_stats.dc_hits++;
+	if (!d->d_file)
+		dc_stats.dc_neghits++;
+	*pf = d->d_file;
+	return true;
+}
+
+// Remember that name in dir is f, or that there is no such file if f
+// is null.
+void
+dcache_enter(struct File *dir, const char *name, struct File *f)
+{
+	uint32_t hash = dir_hash(name);
+	struct Dentry *d = dcache_slot(dir, hash);
+
+	d->d_dir = dir;
+	d->d_file = f;
+	d->d_hash = hash;
+	strcpy(d->d_name, name);
+}
+
+// Forget name in dir, because it is being created or removed.
+void
+dcache_invalidate(struct File *dir, const char *name)
+{
+	uint32_t hash = dir_hash(name);
+	struct Dentry *d = dcache_slot(dir, hash);
+
+	if (d->d_dir == dir && d->d_hash == hash && strcmp(d->d_name, name) == 0) {
+		d->d_dir = NULL;
+		dc_stats.dc_invalidations++;
+	}
+}
+
+// Forget every name in dir, because dir is being removed or truncated
+// and its File may come to hold something else.
+void
+dcache_invalidate_dir(struct File *dir)
+{
+	int i;
+
+	for (i = 0; i < NDENTRY; i++)
+		if (dcache[i].d_dir == dir) {
+			dcache[i].d_dir = NULL;
+			dc_stats.dc_invalidations++;
+		}
+}
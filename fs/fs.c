@@ -39,6 +39,36 @@ block_is_free(uint32_t blockno)
 	return 0;
 }
 
+// The bitmap is searched a word at a time, starting at a rotating hint,
+// and skipping whole groups of BLKGROUP blocks that have no free block
+// according to group_free.
+#define BLKGROUP	1024
+#define GROUPWORDS	(BLKGROUP / 32)
+static uint16_t group_free[DISKSIZE / BLKSIZE / BLKGROUP];
+static uint32_t alloc_hint;	// word to start the next search at
+
+static int
+popcount(uint32_t x)
+{
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+// Count the free blocks of each group.  fsformat leaves the bits past
+// the end of the disk set; clear those in the last word so that a word
+// scan never finds them.
+static void
+bitmap_init(void)
+{
+	uint32_t b, w;
+
+	for (b = super->s_nblocks; b % 32 != 0; b++)
+		bitmap[b/32] &= ~(1 << (b % 32));
+	for (w = 0; w < ROUNDUP(super->s_nblocks, 32) / 32; w++)
+		group_free[w / GROUPWORDS] += popcount(bitmap[w]);
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -46,39 +76,132 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (!(bitmap[blockno/32] & (1<<(blockno%32))))
+		group_free[blockno / BLKGROUP]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
 }
 
+// Mark the n blocks from blockno on in use, flushing the changed bitmap
+// blocks to disk.
+static void
+mark_in_use(uint32_t blockno, uint32_t n)
+{
+	uint32_t b;
+
+	for (b = blockno; b < blockno + n; b++) {
+		bitmap[b/32] &= ~(1 << (b % 32));
+		group_free[b / BLKGROUP]--;
+	}
+	for (b = blockno / BLKBITSIZE; b <= (blockno + n - 1) / BLKBITSIZE; b++)
+		bc_flush_add(diskaddr(2 + b));
+	bc_flush_done();
+}
+
+// Return the index of the first word at or after word w, wrapping
+// around, that has a free block, or -E_NO_DISK if there is none.
+static int
+find_free_word(uint32_t w)
+{
+	uint32_t nwords = ROUNDUP(super->s_nblocks, 32) / 32;
+	uint32_t n;
+
+	if (w >= nwords)
+		w = 0;
+	for (n = 0; n < nwords; n++, w = (w + 1 < nwords ? w + 1 : 0)) {
+		// Skip the rest of a full group at once.
+		if (group_free[w / GROUPWORDS] == 0) {
+			n += GROUPWORDS - 1 - w % GROUPWORDS;
+			w += GROUPWORDS - 1 - w % GROUPWORDS;
+			if (w >= nwords)
+				w = nwords - 1;
+			continue;
+		}
+		if (bitmap[w])
+			return w;
+	}
+	return -E_NO_DISK;
+}
+
 // Search the bitmap for a free block and allocate it.  When you
 // allocate a block, immediately flush the changed bitmap block
 // to disk.
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap.
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
-
-	// LAB 5: Your code here.
-	// panic("alloc_block not implemented");
-	int blockno = -E_NO_DISK;
+	uint32_t blockno;
+	int w;
+
+	// NOTE: 按32位字扫描位图, 用bsf找到字中第一个空闲块
+	if ((w = find_free_word(alloc_hint)) < 0)
+		return w;
+	blockno = w * 32 + __builtin_ctz(bitmap[w]);
+	mark_in_use(blockno, 1);
+	alloc_hint = w;
+	return blockno;
+}
 
-	for(int i = 0; i < super->s_nblocks; ++i) {
-		if(block_is_free(i)) {
-			// 更新bitmap, 并刷新blockno所在的block cache到硬盘
-			blockno = i;
-			bitmap[blockno/32] &= (~(1 << (blockno % 32)));
-			flush_block(&bitmap[blockno/32]);
+// Return the length of the run of free blocks at blockno, counting no
+// further than n.
+static uint32_t
+free_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t b, len = 0;
+
+	while (len < n && (b = blockno + len) < super->s_nblocks) {
+		if (b % 32 == 0 && n - len >= 32 && bitmap[b/32] == ~0U)
+			len += 32;
+		else if (bitmap[b/32] & (1 << (b % 32)))
+			len++;
+		else
 			break;
-		}
 	}
+	return MIN(len, n);
+}
 
-	return blockno;
+// Allocate up to n blocks that are adjacent on disk, taking the first
+// free run of n blocks after the hint, or else the longest run seen in
+// one pass over the bitmap.  Stores the first block in *blockno_store.
+// The changed bitmap blocks are flushed to disk as for alloc_block.
+//
+// Returns the number of blocks allocated (at least 1), or -E_NO_DISK
+// if the disk is full.
+int
+alloc_extent(uint32_t n, uint32_t *blockno_store)
+{
+	uint32_t b, x, step, len, scanned;
+	uint32_t best = 0, bestlen = 0;
+
+	b = alloc_hint * 32;
+	for (scanned = 0; scanned < super->s_nblocks && bestlen < n; scanned += step, b += step) {
+		if (b >= super->s_nblocks)
+			b = 0;
+		if (group_free[b / BLKGROUP] == 0) {
+			step = BLKGROUP - b % BLKGROUP;
+			continue;
+		}
+		// Jump to the next free block in this word, if any.
+		if ((x = bitmap[b/32] >> (b % 32)) == 0) {
+			step = 32 - b % 32;
+			continue;
+		}
+		if ((step = __builtin_ctz(x)) > 0)
+			continue;
+		len = free_run(b, n);
+		if (len > bestlen) {
+			best = b;
+			bestlen = len;
+		}
+		step = len;
+	}
+	if (bestlen == 0)
+		return -E_NO_DISK;
+	mark_in_use(best, bestlen);
+	alloc_hint = (best + bestlen) / 32;
+	*blockno_store = best;
+	return bestlen;
 }
 
 // Validate the file system bitmap.
@@ -118,6 +241,7 @@ fs_init(void)
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	ide_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -127,94 +251,365 @@ fs_init(void)
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
+	bitmap_init();
 	
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
-//
-// Returns:
-//	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
-//		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
-//
-// Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
+// --------------------------------------------------------------
+// Extents
+// --------------------------------------------------------------
+
+// A file's blocks are described by extents, each mapping a run of file
+// blocks to a run of disk blocks, kept sorted by file block.  Blocks
+// that no extent covers are holes.  With f_depth 0 the extents live in
+// f_extent.  With f_depth 1, f_extent indexes extent blocks instead:
+// entry i points (e_diskblk) at the extent block holding the extents for
+// file blocks from its e_fileblk up to the next entry's, and entry 0
+// starts at file block 0.  Lookups binary search at each level.
+
+// Return the index of the last of the n entries of ext whose e_fileblk
+// is at most filebno, or -1 if there is none.
 static int
-file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
+extent_search(struct Extent *ext, uint32_t n, uint32_t filebno)
 {
-       // LAB 5: Your code here.
-       // panic("file_block_walk not implemented");
-
-	if(filebno >= NDIRECT + NINDIRECT)
-		return -E_INVAL;
+	int lo = 0, hi = (int) n - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ext[mid].e_fileblk <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
 
-	else if(filebno < NDIRECT)
-		*ppdiskbno = &f->f_direct[filebno];
+// Find the extent array holding the extents of f around file block
+// filebno.  Sets *ext_store to it and *n_store to its count, and returns
+// the index of its entry in f_extent, or -1 if f_extent is the array.
+static int
+extent_node(struct File *f, uint32_t filebno, struct Extent **ext_store, uint32_t **n_store)
+{
+	struct ExtentBlock *eb;
+	int i;
 
-	else if(f->f_indirect != 0){
-		uint32_t *blk_indirect = diskaddr(f->f_indirect);
-		*ppdiskbno = &blk_indirect[filebno - NDIRECT];
+	if (f->f_depth == 0) {
+		*ext_store = f->f_extent;
+		*n_store = &f->f_nextent;
+		return -1;
 	}
+	i = MAX(extent_search(f->f_extent, f->f_nextent, filebno), 0);
+	eb = diskaddr(f->f_extent[i].e_diskblk);
+	*ext_store = eb->eb_ext;
+	*n_store = &eb->eb_n;
+	return i;
+}
+
+// Return the disk block holding file block filebno of f, or 0 if it is
+// in a hole.  If run_store is not null, sets *run_store to the number of
+// blocks from filebno on that follow it contiguously on disk.
+static uint32_t
+file_map(struct File *f, uint32_t filebno, uint32_t *run_store)
+{
+	struct Extent *ext, *e;
+	uint32_t *n;
+	int i;
+
+	extent_node(f, filebno, &ext, &n);
+	if ((i = extent_search(ext, *n, filebno)) < 0)
+		return 0;
+	e = &ext[i];
+	if (filebno >= e->e_fileblk + e->e_len)
+		return 0;
+	if (run_store)
+		*run_store = e->e_fileblk + e->e_len - filebno;
+	return e->e_diskblk + filebno - e->e_fileblk;
+}
 
-	else if(alloc) {
-		int r = 0;
-		if((r = alloc_block()) < 0)
+// Allocate a zeroed extent block holding the n extents at ext.
+// Returns its block number, or < 0 on error.
+static int
+extent_block_alloc(struct Extent *ext, uint32_t n)
+{
+	struct ExtentBlock *eb;
+	int r;
+
+	if ((r = alloc_block()) < 0)
+		return r;
+	bc_new_block(r);
+	eb = diskaddr(r);
+	memmove(eb->eb_ext, ext, n * sizeof(struct Extent));
+	eb->eb_n = n;
+	return r;
+}
+
+// Make room for one more extent in the array covering filebno: move the
+// extents of f into an extent block if f_extent is full, or split a
+// full extent block in two.  Returns 0 on success, < 0 on error.
+static int
+extent_grow(struct File *f, uint32_t filebno)
+{
+	struct ExtentBlock *eb;
+	int i, r;
+	uint32_t half;
+
+	if (f->f_depth == 0) {
+		if ((r = extent_block_alloc(f->f_extent, f->f_nextent)) < 0)
 			return r;
-		f->f_indirect = r;
-		uint32_t *blk_indirect = diskaddr(f->f_indirect);
-		// 新分配的indirect block, 清空
-		memset(blk_indirect, 0, BLKSIZE);
-		*ppdiskbno = &blk_indirect[filebno - NDIRECT];
+		f->f_extent[0].e_fileblk = 0;
+		f->f_extent[0].e_diskblk = r;
+		f->f_extent[0].e_len = 0;
+		f->f_nextent = 1;
+		f->f_depth = 1;
+		return 0;
 	}
 
+	// The file is too fragmented to describe.
+	if (f->f_nextent == NEXTENT)
+		return -E_FILE_FRAGMENTED;
+	i = MAX(extent_search(f->f_extent, f->f_nextent, filebno), 0);
+	eb = diskaddr(f->f_extent[i].e_diskblk);
+	// NOTE: 在文件末尾追加时只把最后一个extent移到新叶子, 旧叶子保持满,
+	// 否则顺序写出的碎片文件每个叶子只有一半被用上
+	if (i == f->f_nextent - 1
+	    && filebno >= eb->eb_ext[eb->eb_n - 1].e_fileblk + eb->eb_ext[eb->eb_n - 1].e_len)
+		half = eb->eb_n - 1;
 	else
-		return -E_NOT_FOUND;
+		half = eb->eb_n / 2;
+	if ((r = extent_block_alloc(&eb->eb_ext[half], eb->eb_n - half)) < 0)
+		return r;
+	eb->eb_n = half;
+	memmove(&f->f_extent[i + 2], &f->f_extent[i + 1],
+		(f->f_nextent - i - 1) * sizeof(struct Extent));
+	f->f_extent[i + 1].e_fileblk = ((struct ExtentBlock *) diskaddr(r))->eb_ext[0].e_fileblk;
+	f->f_extent[i + 1].e_diskblk = r;
+	f->f_extent[i + 1].e_len = 0;
+	f->f_nextent++;
+	return 0;
+}
+
+// Map the len file blocks from filebno, which must be a hole, to the
+// disk blocks from diskbno, extending a neighboring extent when the new
+// blocks continue it.  Returns 0 on success, < 0 on error.
+static int
+extent_insert(struct File *f, uint32_t filebno, uint32_t diskbno, uint32_t len)
+{
+	struct Extent *ext, *e;
+	uint32_t *n, cap;
+	int i, r;
+
+	extent_node(f, filebno, &ext, &n);
+	i = extent_search(ext, *n, filebno);
+	e = &ext[i];
+	if (i >= 0 && e->e_fileblk + e->e_len == filebno
+	    && e->e_diskblk + e->e_len == diskbno) {
+		e->e_len += len;
+		return 0;
+	}
+	e = &ext[i + 1];
+	if (i + 1 < *n && e->e_fileblk == filebno + len
+	    && e->e_diskblk == diskbno + len) {
+		e->e_fileblk = filebno;
+		e->e_diskblk = diskbno;
+		e->e_len += len;
+		return 0;
+	}
 
+	cap = f->f_depth == 0 ? NEXTENT : NBLKEXTENT;
+	if (*n == cap) {
+		if ((r = extent_grow(f, filebno)) < 0)
+			return r;
+		return extent_insert(f, filebno, diskbno, len);
+	}
+	memmove(&ext[i + 2], &ext[i + 1], (*n - i - 1) * sizeof(struct Extent));
+	ext[i + 1].e_fileblk = filebno;
+	ext[i + 1].e_diskblk = diskbno;
+	ext[i + 1].e_len = len;
+	(*n)++;
 	return 0;
 }
 
+// Free the blocks of the n extents at ext from file block nblocks on,
+// dropping the extents that become empty.
+static void
+extent_trim(struct Extent *ext, uint32_t *n, uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t keep, b;
+
+	while (*n > 0) {
+		e = &ext[*n - 1];
+		if (e->e_fileblk + e->e_len <= nblocks)
+			break;
+		keep = nblocks > e->e_fileblk ? nblocks - e->e_fileblk : 0;
+		for (b = keep; b < e->e_len; b++)
+			free_block(e->e_diskblk + b);
+		e->e_len = keep;
+		if (keep > 0)
+			break;
+		(*n)--;
+	}
+}
+
+static int file_alloc_blocks(struct File *f, uint32_t filebno, uint32_t n);
+
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped, allocating the block
+// if it is in a hole.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
+//	-E_FILE_FRAGMENTED if f has no room for another extent.
 //	-E_INVAL if filebno is out of range.
-//
-// Hint: Use file_block_walk and alloc_block.
 int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
-       // LAB 5: Your code here.
-       // panic("file_get_block not implemented");
-	if(filebno >= NDIRECT+NINDIRECT)
+	uint32_t diskbno;
+	int r;
+
+	if(filebno >= MAXFILESIZE / BLKSIZE)
 		return -E_INVAL;
 
-	uint32_t *pdiskno = NULL;
-	int r = 0;
-	if((r = file_block_walk(f, filebno, &pdiskno, 1)) < 0)
+	// NOTE: 二分查找extent, 不在任何extent中说明是空洞, 需要分配
+	if((diskbno = file_map(f, filebno, NULL)) == 0) {
+		if((r = file_alloc_blocks(f, filebno, 1)) < 0)
+			return r;
+		diskbno = file_map(f, filebno, NULL);
+	}
+
+	*blk = diskaddr(diskbno);
+	if(va_is_mapped(*blk))
+		bc_stats.bc_hits++;
+
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Directories
+// --------------------------------------------------------------
+
+// Set *file to slot number 'slot' of dir, allocating its block if it
+// is past the end of dir.
+static int
+dir_slot(struct File *dir, uint32_t slot, struct File **file)
+{
+	int r;
+	char *blk;
+
+	if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
 		return r;
+	*file = (struct File*) blk + slot % BLKFILES;
+	return 0;
+}
+
+// Set *b to the bucket of dir's index that names with this hash go in.
+static int
+dir_bucket(struct File *dir, struct DirIndex *di, uint32_t hash, struct DirBucket **b)
+{
+	int r;
+	uint32_t n;
+	char *blk;
 
-	if(*pdiskno == 0) {
-		r = alloc_block();
-		if(r < 0)
+	n = di->di_table[hash & ((1 << di->di_depth) - 1)];
+	if ((r = file_get_block(dir, DIRIDX_BLK + 1 + n, &blk)) < 0)
+		return r;
+	*b = (struct DirBucket*) blk;
+	return 0;
+}
+
+// Enter slot in dir's index under hash.  A full bucket is split on the
+// next hash bit, doubling the table first if the bucket already uses
+// all of the bits the table does.
+// Returns 0 on success, < 0 on error.
+static int
+dir_index_add(struct File *dir, struct DirIndex *di, uint32_t hash, uint32_t slot)
+{
+	int r;
+	uint32_t i, j, n, bit;
+	char *blk;
+	struct DirBucket *b, *nb;
+
+	while (1) {
+		if ((r = dir_bucket(dir, di, hash, &b)) < 0)
+			return r;
+		if (b->db_n < NBUCKETENT) {
+			b->db_ent[b->db_n].de_hash = hash;
+			b->db_ent[b->db_n].de_slot = slot;
+			b->db_n++;
+			return 0;
+		}
+		if (b->db_depth == DIRIDX_MAXDEPTH)
+			return -E_NO_DISK;
+
+		// NOTE: 先分配新桶再修改表, 分配失败时索引保持不变
+		if ((r = file_get_block(dir, DIRIDX_BLK + 1 + di->di_nbucket, &blk)) < 0)
 			return r;
-		*pdiskno = r;
-		memset(diskaddr(*pdiskno), 0, BLKSIZE);
+		if (b->db_depth == di->di_depth) {
+			memmove(&di->di_table[1 << di->di_depth], di->di_table,
+				(1 << di->di_depth) * sizeof(uint32_t));
+			di->di_depth++;
+		}
+		n = di->di_table[hash & ((1 << di->di_depth) - 1)];
+		bit = 1 << b->db_depth;
+		nb = (struct DirBucket*) blk;
+		nb->db_depth = ++b->db_depth;
+		nb->db_n = 0;
+		for (i = j = 0; i < b->db_n; i++)
+			if (b->db_ent[i].de_hash & bit)
+				nb->db_ent[nb->db_n++] = b->db_ent[i];
+			else
+				b->db_ent[j++] = b->db_ent[i];
+		b->db_n = j;
+		for (i = 0; i < (1 << di->di_depth); i++)
+			if (di->di_table[i] == n && (i & bit))
+				di->di_table[i] = di->di_nbucket;
+		di->di_nbucket++;
 	}
+}
+
+// Set *di to the index of dir.  A directory without one, such as one
+// written by an older fsformat, gets it built from its slots here.
+// Returns 0 on success, < 0 on error.
+static int
+dir_index(struct File *dir, struct DirIndex **di)
+{
+	int r;
+	uint32_t slot, nslot;
+	char *blk;
+	struct DirBucket *b;
+	struct File *f;
 
-	*blk = diskaddr(*pdiskno);
+	if ((r = file_get_block(dir, DIRIDX_BLK, &blk)) < 0)
+		return r;
+	*di = (struct DirIndex*) blk;
+	if ((*di)->di_magic == DIRIDX_MAGIC)
+		return 0;
 
+	if ((r = file_get_block(dir, DIRIDX_BLK + 1, &blk)) < 0)
+		return r;
+	b = (struct DirBucket*) blk;
+	b->db_depth = 0;
+	b->db_n = 0;
+	nslot = dir->f_size / BLKSIZE * BLKFILES;
+	(*di)->di_depth = 0;
+	(*di)->di_nbucket = 1;
+	(*di)->di_freeslot = nslot;
+	(*di)->di_table[0] = 0;
+	for (slot = 0; slot < nslot; slot++) {
+		if ((r = dir_slot(dir, slot, &f)) < 0)
+			return r;
+		if (f->f_name[0] == '\0')
+			(*di)->di_freeslot = MIN((*di)->di_freeslot, slot);
+		else if ((r = dir_index_add(dir, *di, dir_hash(f->f_name), slot)) < 0)
+			return r;
+	}
+	(*di)->di_magic = DIRIDX_MAGIC;
 	return 0;
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
+// The directory entry cache is asked first; otherwise only the slots
+// the index lists under the hash of name are compared.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
 //	-E_NOT_FOUND if the file is not found
@@ -222,58 +617,131 @@ static int
 dir_lookup(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t i, j, nblock;
-	char *blk;
+	uint32_t i, hash;
+	struct DirIndex *di;
+	struct DirBucket *b;
 	struct File *f;
 
-	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	if (dcache_lookup(dir, name, &f)) {
+		if (!f)
+			return -E_NOT_FOUND;
+		*file = f;
+		return 0;
+	}
+
+	if ((r = dir_index(dir, &di)) < 0)
+		return r;
+	hash = dir_hash(name);
+	if ((r = dir_bucket(dir, di, hash, &b)) < 0)
+		return r;
+	for (i = 0; i < b->db_n; i++) {
+		if (b->db_ent[i].de_hash != hash)
+			continue;
+		if ((r = dir_slot(dir, b->db_ent[i].de_slot, &f)) < 0)
 			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (strcmp(f[j].f_name, name) == 0) {
-				*file = &f[j];
-				return 0;
-			}
+		if (strcmp(f->f_name, name) == 0) {
+			dcache_enter(dir, name, f);
+			*file = f;
+			return 0;
+		}
 	}
+	// NOTE: 不存在的名字也缓存, 再次查找同一个不存在的文件时不用搜索目录
+	dcache_enter(dir, name, NULL);
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, named name and
+// entered in the index.  The caller is responsible for filling in the
+// other File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
-	char *blk;
+	uint32_t slot, nslot;
+	struct DirIndex *di;
 	struct File *f;
 
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	if ((r = dir_index(dir, &di)) < 0)
+		return r;
+	// NOTE: di_freeslot之前没有空闲slot, 从那里开始找, 不用扫描整个目录
+	nslot = dir->f_size / BLKSIZE * BLKFILES;
+	for (slot = di->di_freeslot; slot < nslot; slot++) {
+		if ((r = dir_slot(dir, slot, &f)) < 0)
 			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+		if (f->f_name[0] == '\0')
+			break;
+	}
+	if (slot == nslot) {
+		if (nslot >= DIRIDX_BLK * BLKFILES)
+			return -E_NO_DISK;
+		if ((r = dir_slot(dir, slot, &f)) < 0)
+			return r;
+		dir->f_size += BLKSIZE;
 	}
-	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
+	if ((r = dir_index_add(dir, di, dir_hash(name), slot)) < 0)
 		return r;
-	f = (struct File*) blk;
-	*file = &f[0];
+	strcpy(f->f_name, name);
+	di->di_freeslot = slot + 1;
+	*file = f;
 	return 0;
 }
 
+// Take f, one of the files in dir, out of dir's index, storing its
+// slot number in *slot_store.
+static int
+dir_index_remove(struct File *dir, struct File *f, uint32_t *slot_store)
+{
+	int r;
+	uint32_t i, hash;
+	struct DirIndex *di;
+	struct DirBucket *b;
+	struct File *g;
+
+	if ((r = dir_index(dir, &di)) < 0)
+		return r;
+	hash = dir_hash(f->f_name);
+	if ((r = dir_bucket(dir, di, hash, &b)) < 0)
+		return r;
+	for (i = 0; i < b->db_n; i++) {
+		if (b->db_ent[i].de_hash != hash)
+			continue;
+		if ((r = dir_slot(dir, b->db_ent[i].de_slot, &g)) < 0)
+			return r;
+		if (g == f) {
+			*slot_store = b->db_ent[i].de_slot;
+			di->di_freeslot = MIN(di->di_freeslot, b->db_ent[i].de_slot);
+			b->db_ent[i] = b->db_ent[--b->db_n];
+			return 0;
+		}
+	}
+	return -E_NOT_FOUND;
+}
+
+// Returns 1 if no name is entered in dir's index, 0 if some is, or < 0
+// on error.
+static int
+dir_is_empty(struct File *dir)
+{
+	int r;
+	uint32_t n;
+	char *blk;
+	struct DirIndex *di;
+
+	if ((r = dir_index(dir, &di)) < 0)
+		return r;
+	for (n = 0; n < di->di_nbucket; n++) {
+		if ((r = file_get_block(dir, DIRIDX_BLK + 1 + n, &blk)) < 0)
+			return r;
+		if (((struct DirBucket*) blk)->db_n)
+			return 0;
+	}
+	return 1;
+}
+
 // Skip over slashes.
 static const char*
 skip_slash(const char *p)
@@ -356,10 +824,10 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
 
-	strcpy(f->f_name, name);
+	dcache_enter(dir, name, f);
 	*pf = f;
 	file_flush(dir);
 	return 0;
@@ -376,6 +844,10 @@ file_open(const char *path, struct File **pf)
 // Read count bytes from f into buf, starting from seek position
 // offset.  This meant to mimic the standard pread function.
 // Returns the number of bytes read, < 0 on error.
+//
+// Other threads may run while a block is read from disk, and may
+// truncate f or free the block meanwhile, so the size and the block
+// are looked up again after each read.
 ssize_t
 file_read(struct File *f, void *buf, size_t count, off_t offset)
 {
@@ -388,19 +860,86 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 
 	count = MIN(count, f->f_size - offset);
 
-	for (pos = offset; pos < offset + count; ) {
+	for (pos = offset; pos < offset + count && pos < f->f_size; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
-		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		// NOTE: 不通过缺页读入数据块, 等待磁盘时其他线程可以处理别的请求
+		if (!va_is_mapped(blk)) {
+			bc_fetch(blk);
+			continue;
+		}
+		bn = MIN(BLKSIZE - pos % BLKSIZE, MIN(offset + count, f->f_size) - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
 		pos += bn;
 		buf += bn;
 	}
 
-	return count;
+	return pos - offset;
+}
+
+// Bring blocks filebno through filebno+n-1 of f into the block cache,
+// reading each run of blocks that are adjacent on disk and not cached
+// yet with one disk request.  Holes and blocks past the end of the
+// file are skipped.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t diskbno, run, len;
+	uint32_t end = MIN(filebno + n, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+
+	while (filebno < end) {
+		if ((diskbno = file_map(f, filebno, &run)) == 0) {
+			filebno++;
+			continue;
+		}
+		run = MIN(run, end - filebno);
+		// Skip cached blocks, then take the uncached ones after them.
+		for (len = 0; len < run && va_is_mapped(diskaddr(diskbno + len)); len++)
+			;
+		filebno += len;
+		diskbno += len;
+		run -= len;
+		for (len = 0; len < run && len < BC_RUN_MAX
+			     && !va_is_mapped(diskaddr(diskbno + len)); len++)
+			;
+		if (len > 0)
+			bc_prefetch(diskbno, len);
+		filebno += len;
+	}
 }
 
 
+// Allocate the missing blocks among blocks filebno through
+// filebno+n-1 of f, giving each hole one extent that is contiguous
+// on disk if the bitmap has room for it.
+// Returns 0 on success, < 0 on error.
+static int
+file_alloc_blocks(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t start, want, i;
+	uint32_t end = MIN(filebno + n, MAXFILESIZE / BLKSIZE);
+	int r, got;
+
+	for (; filebno < end; filebno++) {
+		if (file_map(f, filebno, NULL))
+			continue;
+		for (want = 1; filebno + want < end; want++)
+			if (file_map(f, filebno + want, NULL))
+				break;
+		if ((got = alloc_extent(want, &start)) < 0)
+			return got;
+		if ((r = extent_insert(f, filebno, start, got)) < 0) {
+			for (i = 0; i < got; i++)
+				free_block(start + i);
+			return r;
+		}
+		for (i = 0; i < got; i++)
+			bc_new_block(start + i);
+		filebno += got - 1;
+	}
+	return 0;
+}
+
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
 // Extends the file if necessary.
@@ -416,6 +955,9 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
+	if (count > 0 && (r = file_alloc_blocks(f, offset / BLKSIZE,
+			ROUNDUP(offset + count, BLKSIZE) / BLKSIZE - offset / BLKSIZE)) < 0)
+		return r;
 
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
@@ -429,47 +971,41 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error.
-static int
-file_free_block(struct File *f, uint32_t filebno)
-{
-	int r;
-	uint32_t *ptr;
-
-	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
-	if (*ptr) {
-		free_block(*ptr);
-		*ptr = 0;
-	}
-	return 0;
-}
-
 // Remove any blocks currently used by file 'f',
-// but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// but not necessary for a file of size 'newsize',
+// freeing extent blocks that become empty.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int r;
-	uint32_t bno, old_nblocks, new_nblocks;
+	struct ExtentBlock *eb;
+	uint32_t new_nblocks;
+	int i;
 
-	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
-		if ((r = file_free_block(f, bno)) < 0)
-			cprintf("warning: file_free_block: %e", r);
+	if (f->f_depth == 0) {
+		extent_trim(f->f_extent, &f->f_nextent, new_nblocks);
+		return;
+	}
+
+	for (i = f->f_nextent - 1; i >= 0; i--) {
+		eb = diskaddr(f->f_extent[i].e_diskblk);
+		extent_trim(eb->eb_ext, &eb->eb_n, new_nblocks);
+		if (eb->eb_n > 0 || i == 0)
+			break;
+		free_block(f->f_extent[i].e_diskblk);
+		f->f_nextent--;
+	}
 
-	if (new_nblocks <= NDIRECT && f->f_indirect) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+	// Move the extents back into f once they fit.
+	if (f->f_nextent == 1) {
+		eb = diskaddr(f->f_extent[0].e_diskblk);
+		if (eb->eb_n <= NEXTENT) {
+			free_block(f->f_extent[0].e_diskblk);
+			f->f_nextent = eb->eb_n;
+			memmove(f->f_extent, eb->eb_ext, eb->eb_n * sizeof(struct Extent));
+			f->f_depth = 0;
+		}
 	}
 }
 
@@ -477,41 +1013,98 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	if (f->f_size > newsize) {
 		file_truncate_blocks(f, newsize);
+		// The names in the slots cut off are gone.
+		if (f->f_type == FTYPE_DIR)
+			dcache_invalidate_dir(f);
+	}
 	f->f_size = newsize;
 	flush_block(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Walk the extents in file order and queue the dirty blocks for
+// writing, so that blocks adjacent on disk go out together.
 void
 file_flush(struct File *f)
 {
-	int i;
-	uint32_t *pdiskbno;
-
-	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
-			continue;
-		flush_block(diskaddr(*pdiskbno));
+	struct ExtentBlock *eb;
+	struct Extent *ext;
+	uint32_t i, n, j, b;
+
+	for (i = 0; i < (f->f_depth ? f->f_nextent : 1); i++) {
+		if (f->f_depth) {
+			eb = diskaddr(f->f_extent[i].e_diskblk);
+			ext = eb->eb_ext;
+			n = eb->eb_n;
+		} else {
+			ext = f->f_extent;
+			n = f->f_nextent;
+		}
+		for (j = 0; j < n; j++)
+			for (b = 0; b < ext[j].e_len; b++)
+				bc_flush_add(diskaddr(ext[j].e_diskblk + b));
 	}
-	flush_block(f);
-	if (f->f_indirect)
-		flush_block(diskaddr(f->f_indirect));
+	bc_flush_add(f);
+	for (i = 0; f->f_depth && i < f->f_nextent; i++)
+		bc_flush_add(diskaddr(f->f_extent[i].e_diskblk));
+	bc_flush_done();
 }
 
 
+// Remove "path", freeing its blocks.  Returns 0 on success, < 0 on
+// error.  Errors are:
+//	-E_FILE_BUSY if the file is open
+//	-E_INVAL if it is a directory that is not empty
+int
+file_remove(const char *path)
+{
+	int r;
+	uint32_t slot;
+	struct File *dir, *f;
+	struct DirIndex *di;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	// The root directory cannot be removed.
+	if (dir == 0)
+		return -E_BAD_PATH;
+	if ((r = dir_index_remove(dir, f, &slot)) < 0)
+		return r;
+	dcache_invalidate(dir, f->f_name);
+
+	// NOTE: 先把名字从索引中去掉再检查, 检查期间线程切换出去时别的请求已经
+	// 找不到f, 不会再打开它或者在它下面创建文件. 打开的文件不能删: 文件的slot
+	// 会被dir_alloc_file分给新文件, 旧的fd就会改到新文件上
+	if (file_is_open(f))
+		r = -E_FILE_BUSY;
+	else if (f->f_type == FTYPE_DIR && (r = dir_is_empty(f)) >= 0)
+		r = r ? 0 : -E_INVAL;
+	if (r < 0) {
+		// 放回索引. 普通文件的检查不会切换线程, 桶中刚空出的一项还在;
+		// 检查目录时桶可能被别的请求填满, dir_index_add会分裂它
+		if (dir_index(dir, &di) < 0 ||
+		    dir_index_add(dir, di, dir_hash(f->f_name), slot) < 0)
+			cprintf("file_remove: lost %s from its directory\n", f->f_name);
+		return r;
+	}
+	if (f->f_type == FTYPE_DIR)
+		dcache_invalidate_dir(f);
+
+	file_truncate_blocks(f, 0);
+	memset(f, 0, sizeof(struct File));
+	file_flush(dir);
+	return 0;
+}
+
 // Sync the entire file system.  A big hammer.
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	bc_sync();
 }
 
@@ -11,23 +11,83 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Blocks the block cache holds before it starts evicting, by default
+ * and at least.  FSREQ_STATS can change the cap at run time. */
+#define BC_DEFAULT_CAP	1024
+#define BC_MIN_CAP	16
+
+/* Sequential readers get blocks read ahead in windows of this many
+ * blocks, doubling from BC_RA_MIN up to BC_RA_MAX (one 256-sector
+ * disk request). */
+#define BC_RA_MIN	4
+#define BC_RA_MAX	32
+
+/* Most blocks read or written with one disk request (256 sectors) */
+#define BC_RUN_MAX	32
+
+/* Blocks bc_prefetch and bc_fetch read land in an area of BC_RUN_MAX
+ * pages at BC_STAGE, one per thread, and are mapped into the cache once
+ * the disk is done with them. */
+#define BC_STAGE	0x0E000000
+
+/* Threads serving requests */
+#define NTHREAD		8
+
 // NOTE: 原来的代码有问题, 在头文件中声明了两个指针, 导致重定义错误
 // struct Super *super;		// superblock
 // uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* A disk transfer queued with ide_submit. */
+struct ide_req {
+	uint32_t r_secno;		// first sector
+	void *r_buf;			// must stay mapped until r_done
+	size_t r_nsecs;			// at most 256
+	bool r_write;
+	volatile bool r_done;		// set when the transfer completes
+	int r_result;			// 0, or -1 on a disk error
+	struct ide_req *r_next;
+};
+
 /* ide.c */
+void	ide_init(void);
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+void	ide_submit(struct ide_req *req);
+bool	ide_poll(void);
+int	ide_wait(struct ide_req *req);
+
+/* thread.c */
+int	thread_create(void (*fn)(void *), void *arg);
+void	thread_run(int id);
+void	thread_yield(void);
+int	thread_self(void);
+bool	thread_ready(int id);
+int	thread_wait_io(struct ide_req *req);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	bc_flush_add(void *addr);
+void	bc_flush_done(void);
+void	bc_sync(void);
 void	bc_init(void);
+void	bc_set_cap(uint32_t cap);
+void	bc_prefetch(uint32_t blockno, uint32_t n);
+void	bc_fetch(void *addr);
+void	bc_new_block(uint32_t blockno);
+extern struct BcStats bc_stats;
+
+/* dcache.c */
+bool	dcache_lookup(struct File *dir, const char *name, struct File **pf);
+void	dcache_enter(struct File *dir, const char *name, struct File *f);
+void	dcache_invalidate(struct File *dir, const char *name);
+void	dcache_invalidate_dir(struct File *dir);
+extern struct DcStats dc_stats;
 
 /* fs.c */
 void	fs_init(void);
@@ -35,6 +95,7 @@ int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t n);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
@@ -44,6 +105,10 @@ void	fs_sync(void);
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_extent(uint32_t n, uint32_t *blockno_store);
+
+/* serv.c */
+bool	file_is_open(struct File *f);
 
 /* test.c */
 void	fs_test(void);
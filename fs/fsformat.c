@@ -134,16 +134,15 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	// Files are laid out contiguously, so one extent covers them.
 	f->f_size = len;
-	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	f->f_depth = 0;
+	f->f_nextent = 0;
+	if (len > 0) {
+		f->f_extent[0].e_fileblk = 0;
+		f->f_extent[0].e_diskblk = start;
+		f->f_extent[0].e_len = ROUNDUP(len, BLKSIZE) / BLKSIZE;
+		f->f_nextent = 1;
 	}
 }
 
@@ -166,6 +165,35 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Write the index of directory d, with every name in a single bucket,
+// and add its extent at file block DIRIDX_BLK of the directory.
+void
+finishindex(struct Dir *d)
+{
+	struct DirIndex *di = alloc(2 * BLKSIZE);
+	struct DirBucket *b = (struct DirBucket *) ((char *) di + BLKSIZE);
+	int i;
+
+	if (d->n > NBUCKETENT)
+		panic("too many directory entries for one bucket");
+	di->di_magic = DIRIDX_MAGIC;
+	di->di_depth = 0;
+	di->di_nbucket = 1;
+	di->di_freeslot = d->n;
+	di->di_table[0] = 0;
+	b->db_depth = 0;
+	b->db_n = d->n;
+	for (i = 0; i < d->n; i++) {
+		b->db_ent[i].de_hash = dir_hash(d->ents[i].f_name);
+		b->db_ent[i].de_slot = i;
+	}
+
+	i = d->f->f_nextent++;
+	d->f->f_extent[i].e_fileblk = DIRIDX_BLK;
+	d->f->f_extent[i].e_diskblk = blockof(di);
+	d->f->f_extent[i].e_len = 2;
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,6 +201,7 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	finishindex(d);
 	free(d->ents);
 	d->ents = NULL;
 }
@@ -228,7 +257,7 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > BLKBITSIZE)
 		usage();
 
 	opendisk(argv[1]);
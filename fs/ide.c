@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * IDE driver code.  Transfers go through the PCI Bus Master IDE
+ * controller (PIIX) when there is one, with IRQ 14 delivered to us by
+ * sys_irq_wait; otherwise we fall back to polled PIO.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +14,54 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// PCI configuration space access
+#define PCI_CONFIG_ADDR	0xCF8
+#define PCI_CONFIG_DATA	0xCFC
+#define PCI_ID		0x00
+#define PCI_COMMAND	0x04
+#define PCI_CLASS	0x08
+#define PCI_BAR4	0x20
+#define PCI_COMMAND_IO		0x01
+#define PCI_COMMAND_MASTER	0x04
+
+// Bus master registers of the primary channel, relative to BAR4
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+#define BM_CMD_START	0x01
+#define BM_CMD_TOMEM	0x08	// device to memory, i.e. a disk read
+#define BM_ST_ACTIVE	0x01
+#define BM_ST_ERR	0x02
+#define BM_ST_INTR	0x04
+
+// Physical region descriptor: one physically contiguous piece of a
+// transfer, which must not cross a 64KB boundary.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;	// 0 means 64KB
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last entry of the table
+
 static int diskno = 1;
 
+// I/O base of the bus master registers, or 0 to use PIO.
+static uint16_t bmbase;
+
+// The PRD table handed to the controller.  One page holds enough entries
+// for the largest transfer, since every entry covers up to a page.
+static struct Prd prdt[PGSIZE / sizeof(struct Prd)] __attribute__((aligned(PGSIZE)));
+
+// Requests waiting for the disk, oldest first.  The head is the one the
+// controller is working on.
+static struct ide_req *ide_queue;
+static struct ide_req **ide_queue_tail = &ide_queue;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,22 +107,74 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
+static uint32_t
+pci_conf_read(int dev, int func, int reg)
+{
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+	return inl(PCI_CONFIG_DATA);
+}
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+static void
+pci_conf_write(int dev, int func, int reg, uint32_t v)
 {
-	int r;
+	outl(PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+	outl(PCI_CONFIG_DATA, v);
+}
 
-	assert(nsecs <= 256);
+// Look for a bus-master capable IDE controller on PCI bus 0 and turn on
+// its bus mastering.  Without one, every transfer uses PIO.
+void
+ide_init(void)
+{
+	int dev, func, r;
+	uint32_t class, bar;
 
-	ide_wait_ready(0);
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(dev, func, PCI_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			class = pci_conf_read(dev, func, PCI_CLASS);
+			// mass storage, IDE, bus master capable
+			if ((class >> 16) != 0x0101 || !(class & (0x80 << 8)))
+				continue;
+			bar = pci_conf_read(dev, func, PCI_BAR4);
+			if (!(bar & 1) || (bar & ~3) == 0)
+				continue;
+			pci_conf_write(dev, func, PCI_COMMAND,
+				       pci_conf_read(dev, func, PCI_COMMAND)
+				       | PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+			bmbase = bar & 0xFFFC;
+			// Let the drive raise IRQ 14 (clear nIEN), and have it
+			// end serve()'s receives too, so that serve() can wait
+			// for a request and for the disk at once.
+			outb(0x3F6, 0);
+			if ((r = sys_irq_bind(IRQ_IDE)) < 0)
+				panic("ide_init: sys_irq_bind: %e", r);
+			cprintf("IDE bus master at %02x.%d, port 0x%x\n",
+				dev, func, bmbase);
+			return;
+		}
+	cprintf("IDE bus master not found, using PIO\n");
+}
 
+static void
+ide_command(uint32_t secno, size_t nsecs, int cmd)
+{
 	outb(0x1F2, nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
+
+static int
+ide_pio_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	ide_wait_ready(0);
+	ide_command(secno, nsecs, IDE_CMD_READ);
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -85,21 +185,13 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+static int
+ide_pio_write(uint32_t secno, const void *src, size_t nsecs)
 {
 	int r;
 
-	assert(nsecs <= 256);
-
 	ide_wait_ready(0);
-
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	ide_command(secno, nsecs, IDE_CMD_WRITE);
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -110,3 +202,122 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 	return 0;
 }
 
+// Point the controller at req's buffer and start the transfer.
+static void
+ide_dma_start(struct ide_req *req)
+{
+	uintptr_t va = (uintptr_t) req->r_buf;
+	size_t n, left = req->r_nsecs * SECTSIZE;
+	int i;
+
+	for (i = 0; left > 0; i++, va += n, left -= n) {
+		n = MIN(left, PGSIZE - PGOFF(va));
+		// Make sure the page is our own before the device writes
+		// it: it may still be shared copy-on-write.
+		if (!req->r_write)
+			*(volatile char *) va = *(volatile char *) va;
+		prdt[i].prd_addr = PTE_ADDR(uvpt[PGNUM(va)]) | PGOFF(va);
+		prdt[i].prd_len = n;
+		prdt[i].prd_flags = 0;
+	}
+	prdt[i - 1].prd_flags = PRD_EOT;
+
+	ide_wait_ready(0);
+	outb(bmbase + BM_CMD, 0);
+	outb(bmbase + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+	outl(bmbase + BM_PRDT, PTE_ADDR(uvpt[PGNUM(prdt)]));
+	ide_command(req->r_secno, req->r_nsecs,
+		    req->r_write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(bmbase + BM_CMD, (req->r_write ? 0 : BM_CMD_TOMEM) | BM_CMD_START);
+}
+
+// Queue 'req' for the disk.  With a bus master controller the transfer
+// runs while we do other work; call ide_poll or ide_wait to find out
+// when it is done.  Without one, req completes before we return.
+void
+ide_submit(struct ide_req *req)
+{
+	assert(req->r_nsecs > 0 && req->r_nsecs <= 256);
+
+	req->r_done = false;
+	req->r_next = NULL;
+	if (!bmbase) {
+		if (req->r_write)
+			req->r_result = ide_pio_write(req->r_secno, req->r_buf, req->r_nsecs);
+		else
+			req->r_result = ide_pio_read(req->r_secno, req->r_buf, req->r_nsecs);
+		req->r_done = true;
+		return;
+	}
+
+	*ide_queue_tail = req;
+	ide_queue_tail = &req->r_next;
+	if (ide_queue == req)
+		ide_dma_start(req);
+}
+
+// Retire the request at the head of the queue if the controller has
+// finished it, and start the next one.  Returns true if it retired one.
+bool
+ide_poll(void)
+{
+	struct ide_req *req;
+	int bmst, st;
+
+	if (!(req = ide_queue))
+		return false;
+	bmst = inb(bmbase + BM_STATUS);
+	if ((bmst & BM_ST_ACTIVE) && !(bmst & BM_ST_ERR))
+		return false;
+
+	outb(bmbase + BM_CMD, 0);
+	// Reading the status register also deasserts the drive's IRQ.
+	st = inb(0x1F7);
+	outb(bmbase + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+	if ((bmst & BM_ST_ERR) || (st & (IDE_DF|IDE_ERR)))
+		req->r_result = -1;
+	else
+		req->r_result = 0;
+	req->r_done = true;
+
+	if (!(ide_queue = req->r_next))
+		ide_queue_tail = &ide_queue;
+	else
+		ide_dma_start(ide_queue);
+	return true;
+}
+
+// Wait for 'req' to complete, sleeping on IRQ 14 rather than spinning.
+int
+ide_wait(struct ide_req *req)
+{
+	int r;
+
+	while (!req->r_done) {
+		if (ide_poll())
+			continue;
+		if ((r = sys_irq_wait(IRQ_IDE)) < 0)
+			panic("ide_wait: sys_irq_wait: %e", r);
+	}
+	return req->r_result;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	struct ide_req req = { .r_secno = secno, .r_buf = dst,
+			       .r_nsecs = nsecs, .r_write = false };
+
+	ide_submit(&req);
+	return ide_wait(&req);
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct ide_req req = { .r_secno = secno, .r_buf = (void *) src,
+			       .r_nsecs = nsecs, .r_write = true };
+
+	ide_submit(&req);
+	return ide_wait(&req);
+}
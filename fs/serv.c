@@ -34,18 +34,28 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	uint32_t o_bufmask;	// pages of the shared buffer set up so far
+	off_t o_ra_pos;		// where a sequential read would start
+	uint32_t o_ra_end;	// first file block not read ahead yet
+	uint32_t o_ra_win;	// current read-ahead window, in blocks
 };
 
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
+// Shared buffers (see FSREQ_SETBUF), FSBUF_SIZE bytes per open file
+#define FSBUFVA		(FILEVA + MAXOPEN*PGSIZE)
+
+// Return the shared buffer of open file o
+#define OPENFILE_BUF(o)	((char*) FSBUFVA + ((o) - opentab) * FSBUF_SIZE)
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
+// Virtual address at which to receive page mappings containing client
+// requests.  Each worker of serve() has its own page, from here down.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
 void
@@ -60,6 +70,19 @@ serve_init(void)
 	}
 }
 
+// Drop the shared buffer pages left over from the last user of o.
+static void
+openfile_freebuf(struct OpenFile *o)
+{
+	int i;
+
+	for (i = 0; o->o_bufmask; i++)
+		if (o->o_bufmask & (1 << i)) {
+			sys_page_unmap(0, OPENFILE_BUF(o) + i*PGSIZE);
+			o->o_bufmask &= ~(1 << i);
+		}
+}
+
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
@@ -77,6 +100,10 @@ openfile_alloc(struct OpenFile **o)
 			opentab[i].o_fileid += MAXOPEN;
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
+			openfile_freebuf(*o);
+			(*o)->o_ra_pos = 0;
+			(*o)->o_ra_end = 0;
+			(*o)->o_ra_win = 0;
 			return (*o)->o_fileid;
 		}
 	}
@@ -96,6 +123,18 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	return 0;
 }
 
+// Returns true if some environment has f open.
+bool
+file_is_open(struct File *f)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file == f && pageref(opentab[i].o_fd) > 1)
+			return true;
+	return false;
+}
+
 // Open req->req_path in mode req->req_omode, storing the Fd page and
 // permissions to return to the calling environment in *pg_store and
 // *perm_store respectively.
@@ -200,6 +239,38 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Get o's file ready for a read of count bytes at offset.  A read that
+// starts where the last one ended is sequential: once it gets within
+// half a window of the blocks read ahead so far, read the next window
+// ahead and double the window.  Any other read resets the window, and
+// only brings in the blocks it needs, in as few disk requests as
+// possible.
+static void
+openfile_readahead(struct OpenFile *o, off_t offset, size_t count)
+{
+	struct File *f = o->o_file;
+	uint32_t b, e, nblocks;
+
+	if (offset < 0 || offset >= f->f_size || count == 0)
+		return;
+	count = MIN(count, f->f_size - offset);
+	b = offset / BLKSIZE;
+	e = ROUNDUP(offset + count, BLKSIZE) / BLKSIZE;
+	nblocks = ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE;
+
+	if (offset != o->o_ra_pos) {
+		o->o_ra_win = 0;
+		o->o_ra_end = e;
+	} else if (e + o->o_ra_win / 2 > o->o_ra_end) {
+		// NOTE: 窗口不超过缓存上限的1/4, 以免预读的块在使用前被换出
+		o->o_ra_win = o->o_ra_win ? o->o_ra_win * 2 : BC_RA_MIN;
+		o->o_ra_win = MIN(o->o_ra_win, MIN(BC_RA_MAX, bc_stats.bc_cap / 4));
+		o->o_ra_end = MIN(MAX(e, o->o_ra_end) + o->o_ra_win, nblocks);
+	}
+	o->o_ra_pos = offset + count;
+	file_readahead(f, b, MAX(e, o->o_ra_end) - b);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -220,6 +291,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if((r = openfile_lookup(envid, req->req_fileid, &o)) < 0 || o == NULL)
 		return r;
 
+	openfile_readahead(o, o->o_fd->fd_offset, MIN(req->req_n, PGSIZE));
 	ssize_t count = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset);
 	if(count >= 0)
 		o->o_fd->fd_offset += count;
@@ -227,6 +299,222 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return count;
 }
 
+// Find the block cache page holding byte 'offset' of open file o, which
+// must be page-aligned, and bring it in so that it can be sent.
+// Returns the number of file bytes in the page, 0 at end of file, or
+// < 0 on error.
+static int
+openfile_map(struct OpenFile *o, off_t offset, char **blk)
+{
+	int n, r;
+
+	if (offset < 0 || PGOFF(offset) != 0)
+		return -E_INVAL;
+
+	// Other requests run while bc_fetch waits for the disk, and may
+	// truncate the file or free the block, so look both up again
+	// until the block is found in the cache.  Only mapped pages can
+	// be sent; check for that last, so touching o_file cannot evict
+	// the block again.
+	while (1) {
+		if (offset >= o->o_file->f_size)
+			return 0;
+		n = MIN(BLKSIZE, o->o_file->f_size - offset);
+		if ((r = file_get_block(o->o_file, offset / BLKSIZE, blk)) < 0)
+			return r;
+		if (va_is_mapped(*blk))
+			return n;
+		bc_fetch(*blk);
+	}
+}
+
+// Map the block holding byte req->req_offset of req->req_fileid into
+// the caller read-only, storing the block cache page and its
+// permissions in *pg_store and *perm_store.  The page itself is sent,
+// so the data is never copied; the caller also sees any later writes to
+// the block.  req_offset must be page-aligned.  Returns the number of
+// file bytes in the page (0 at end of file), or < 0 on error.
+int
+serve_read_map(envid_t envid, struct Fsreq_read_map *req,
+	       void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	openfile_readahead(o, req->req_offset, BLKSIZE);
+	if ((r = openfile_map(o, req->req_offset, &blk)) <= 0)
+		return r;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U;
+	return r;
+}
+
+// Like serve_read_map, but the page is shared with PTE_SHARE, and is
+// writable if req->req_write is set and the file is open for writing.
+// Changes the client makes to a writable page reach the disk when it
+// asks for them with FSREQ_MSYNC.
+int
+serve_mmap(envid_t envid, struct Fsreq_mmap *req,
+	   void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_mmap %08x %08x %08x %d\n", envid, req->req_fileid,
+			req->req_offset, req->req_write);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_write && (o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if ((r = openfile_map(o, req->req_offset, &blk)) <= 0)
+		return r;
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_SHARE | (req->req_write ? PTE_W : 0);
+	return r;
+}
+
+// Write the blocks of ipc->msync.req_fileid listed in req_blocks to
+// disk.  Clients write to mmapped pages through their own mappings,
+// which we never see, so mark each block dirty ourselves first.
+// Returns 0 on success, < 0 on error.
+int
+serve_msync(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_msync *req = &ipc->msync;
+	struct OpenFile *o;
+	char *blk;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_msync %08x %08x %d\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_n < 0 || req->req_n > FSMSYNC_MAX)
+		return -E_INVAL;
+	for (i = 0; i < req->req_n; i++) {
+		if (req->req_blocks[i] >= ROUNDUP(o->o_file->f_size, BLKSIZE) / BLKSIZE) {
+			r = -E_INVAL;
+			break;
+		}
+		if ((r = file_get_block(o->o_file, req->req_blocks[i], &blk)) < 0)
+			break;
+		// A locked read-modify-write that changes nothing: it marks
+		// the block dirty without racing the client's stores.
+		asm volatile("lock; orl $0, %0" : "+m" (*(uint32_t *) blk) : : "cc");
+		bc_flush_add(blk);
+	}
+	bc_flush_done();
+	return r < 0 ? r : 0;
+}
+
+// Make the request page, which the client keeps mapped, page
+// req->req_page of req->req_fileid's shared buffer.  Returns 0 on
+// success, < 0 on error.
+int
+serve_setbuf(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_setbuf *req = &ipc->setbuf;
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_setbuf %08x %08x %d\n", envid, req->req_fileid, req->req_page);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_page < 0 || req->req_page >= FSBUF_PAGES)
+		return -E_INVAL;
+	if ((r = sys_page_map(0, ipc, 0, OPENFILE_BUF(o) + req->req_page*PGSIZE,
+			      PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	o->o_bufmask |= 1 << req->req_page;
+	return 0;
+}
+
+// Move data between the current seek position of req->req_fileid and
+// the ranges of its shared buffer in req->req_iov, in order, and update
+// the seek position.  Stops early at the end of the file or on error.
+// Returns the number of bytes moved, or < 0 if nothing was moved
+// because of an error.
+static int
+serve_rwv(envid_t envid, struct Fsreq_rwv *req, bool write)
+{
+	struct OpenFile *o;
+	struct Fsiov *iov;
+	uint32_t need;
+	int i, r, total;
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_niov < 0 || req->req_niov > FSIOV_MAX)
+		return -E_INVAL;
+	for (i = 0; i < req->req_niov; i++) {
+		iov = &req->req_iov[i];
+		if (iov->iov_len == 0)
+			continue;
+		if (iov->iov_off >= FSBUF_SIZE || iov->iov_len > FSBUF_SIZE - iov->iov_off)
+			return -E_INVAL;
+		// Bits for every buffer page the range touches
+		need = (2 << ((iov->iov_off + iov->iov_len - 1) / PGSIZE))
+			- (1 << (iov->iov_off / PGSIZE));
+		if ((o->o_bufmask & need) != need)
+			return -E_INVAL;
+	}
+
+	if (!write) {
+		for (i = total = 0; i < req->req_niov; i++)
+			total += req->req_iov[i].iov_len;
+		openfile_readahead(o, o->o_fd->fd_offset, total);
+	}
+
+	total = 0;
+	for (i = 0; i < req->req_niov; i++) {
+		iov = &req->req_iov[i];
+		if (write)
+			r = file_write(o->o_file, OPENFILE_BUF(o) + iov->iov_off,
+				       iov->iov_len, o->o_fd->fd_offset);
+		else
+			r = file_read(o->o_file, OPENFILE_BUF(o) + iov->iov_off,
+				      iov->iov_len, o->o_fd->fd_offset);
+		if (r < 0)
+			return total > 0 ? total : r;
+		o->o_fd->fd_offset += r;
+		total += r;
+		if (r < iov->iov_len)
+			break;
+	}
+	return total;
+}
+
+// Read into the shared buffer of ipc->rwv.req_fileid; see serve_rwv.
+int
+serve_readv(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_readv %08x %08x %d\n", envid, ipc->rwv.req_fileid, ipc->rwv.req_niov);
+
+	return serve_rwv(envid, &ipc->rwv, 0);
+}
+
+// Write from the shared buffer of ipc->rwv.req_fileid; see serve_rwv.
+int
+serve_writev(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_writev %08x %08x %d\n", envid, ipc->rwv.req_fileid, ipc->rwv.req_niov);
+
+	return serve_rwv(envid, &ipc->rwv, 1);
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -292,6 +580,22 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 }
 
 
+// Remove the file req->req_path.
+int
+serve_remove(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_remove *req = &ipc->remove;
+	char path[MAXPATHLEN];
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+	return file_remove(path);
+}
+
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
@@ -299,51 +603,190 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache and directory entry cache counters, first
+// changing the block cache cap if req_cap is not 0.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_stats *req = &ipc->stats;
+	struct Fsret_stats *ret = &ipc->statsRet;
+
+	if (debug)
+		cprintf("serve_stats %08x %08x\n", envid, req->req_cap);
+
+	if (req->req_cap)
+		bc_set_cap(req->req_cap);
+	ret->ret_bc = bc_stats;
+	ret->ret_dc = dc_stats;
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
-	// Open is handled specially because it passes pages
+	// Open, read map and mmap are handled specially because they pass pages
 	/* [FSREQ_OPEN] =	(fshandler)serve_open, */
+	/* [FSREQ_READ_MAP] =	(fshandler)serve_read_map, */
+	/* [FSREQ_MMAP] =	(fshandler)serve_mmap, */
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_REMOVE] =	serve_remove,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_SETBUF] =	serve_setbuf,
+	[FSREQ_READV] =		serve_readv,
+	[FSREQ_WRITEV] =	serve_writev,
+	[FSREQ_MSYNC] =		serve_msync,
+	[FSREQ_STATS] =		serve_stats
+};
+
+// Each request is served by a worker thread, which has its own page to
+// receive the request in.  A worker waiting for the disk lets the others
+// run, and serve() keeps receiving requests while any worker is idle.
+enum {
+	WORKER_IDLE = 0,
+	WORKER_BUSY,		// serving w_reqno
+	WORKER_DONE,		// the reply is ready
 };
 
+struct Worker {
+	int w_status;
+	int w_thread;
+	union Fsipc *w_req;		// where its request page is received
+	uint32_t w_reqno;
+	envid_t w_whom;
+	// The reply
+	int w_r;
+	void *w_pg;
+	int w_rperm;
+};
+
+static struct Worker workers[NTHREAD];
+
+static void
+serve_worker(void *arg)
+{
+	struct Worker *w = arg;
+
+	while (1) {
+		if (debug)
+			cprintf("fs req %d from %08x [page %08x: %s]\n",
+				w->w_reqno, w->w_whom, uvpt[PGNUM(w->w_req)], w->w_req);
+
+		w->w_pg = NULL;
+		w->w_rperm = 0;
+		if (w->w_reqno == FSREQ_OPEN) {
+			w->w_r = serve_open(w->w_whom, (struct Fsreq_open*)w->w_req, &w->w_pg, &w->w_rperm);
+		} else if (w->w_reqno == FSREQ_READ_MAP) {
+			w->w_r = serve_read_map(w->w_whom, (struct Fsreq_read_map*)w->w_req, &w->w_pg, &w->w_rperm);
+		} else if (w->w_reqno == FSREQ_MMAP) {
+			w->w_r = serve_mmap(w->w_whom, (struct Fsreq_mmap*)w->w_req, &w->w_pg, &w->w_rperm);
+		} else if (w->w_reqno < ARRAY_SIZE(handlers) && handlers[w->w_reqno]) {
+			w->w_r = handlers[w->w_reqno](w->w_whom, w->w_req);
+		} else {
+			cprintf("Invalid request code %d from %08x\n", w->w_reqno, w->w_whom);
+			w->w_r = -E_INVAL;
+		}
+		sys_page_unmap(0, w->w_req);
+		w->w_status = WORKER_DONE;
+		thread_yield();
+	}
+}
+
+// Send w's reply now.  A client that sent with plain ipc_send may not
+// have reached ipc_recv yet; the kernel then queues the reply for it, so
+// the server goes on serving the others.  A client that has gone away
+// just loses its reply.
+static void
+serve_reply(struct Worker *w)
+{
+	int r;
+
+	r = sys_ipc_reply(w->w_whom, w->w_r, w->w_pg ? w->w_pg : (void *) UTOP, w->w_rperm);
+	if (r < 0 && r != -E_BAD_ENV)
+		cprintf("fs: reply to %08x: %e\n", w->w_whom, r);
+	w->w_status = WORKER_IDLE;
+}
+
 void
 serve(void)
 {
+	struct Worker *w, *reply;
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	int i, perm, r;
+	bool ran;
 
+	for (i = 0; i < NTHREAD; i++) {
+		workers[i].w_req = (union Fsipc *) ((uintptr_t) fsreq - i * PGSIZE);
+		workers[i].w_thread = thread_create(serve_worker, &workers[i]);
+	}
+
+	reply = NULL;
 	while (1) {
+		// Run the workers that can make progress until all of them
+		// are idle or wait for the disk.  A finished worker is
+		// answered before another one runs, since that one could
+		// evict the page a read map replies with; the last one's
+		// reply goes out with the next receive.
+		do {
+			ran = false;
+			while (ide_poll())
+				/* do nothing */;
+			for (i = 0; i < NTHREAD; i++) {
+				w = &workers[i];
+				if (w->w_status != WORKER_BUSY || !thread_ready(w->w_thread))
+					continue;
+				if (reply) {
+					serve_reply(reply);
+					reply = NULL;
+				}
+				thread_run(w->w_thread);
+				if (w->w_status == WORKER_DONE)
+					reply = w;
+				ran = true;
+			}
+		} while (ran);
+
+		// Receive into an idle worker's page, or just wait for the
+		// disk if every worker is busy.  Disk interrupts arrive as
+		// messages from envid 0 (see sys_irq_bind).
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
-		if (debug)
-			cprintf("fs req %d from %08x [page %08x: %s]\n",
-				req, whom, uvpt[PGNUM(fsreq)], fsreq);
+		if (reply) {
+			w = reply;
+			reply = NULL;
+			w->w_status = WORKER_IDLE;
+			req = ipc_reply_recv(w->w_whom, w->w_r, w->w_pg, w->w_rperm,
+					     (int32_t *) &whom, w->w_req, &perm);
+			if ((int32_t) req < 0) {
+				cprintf("fs: reply to %08x: %e\n", w->w_whom, req);
+				continue;
+			}
+		} else {
+			for (i = 0; i < NTHREAD && workers[i].w_status != WORKER_IDLE; i++)
+				/* do nothing */;
+			if (i == NTHREAD) {
+				if ((r = sys_irq_wait(IRQ_IDE)) < 0)
+					panic("serve: sys_irq_wait: %e", r);
+				continue;
+			}
+			w = &workers[i];
+			req = ipc_recv((int32_t *) &whom, w->w_req, &perm);
+		}
+		if (whom == 0)
+			continue;
 
 		// All requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
-		}
-
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
+			// just leave it hanging...
+			continue;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		w->w_reqno = req;
+		w->w_whom = whom;
+		w->w_status = WORKER_BUSY;
 	}
 }
 
@@ -0,0 +1,122 @@
+/*
+ * Cooperative threads for the file server.  serve() runs each request
+ * on one of NTHREAD threads, so that a request waiting for a disk read
+ * does not hold up requests the block cache can answer.
+ *
+ * A thread only gives up the CPU in thread_wait_io, and bc_prefetch and
+ * bc_fetch are its only callers: a thread never switches inside the
+ * page fault handler, or while it is changing file system metadata.  So
+ * the code between two reads of file data runs without interruption and
+ * needs no locks, and all of the server's state stays in one address
+ * space.  What a thread learned before a read may be stale after it,
+ * though: another request may have truncated the file or freed the
+ * block meanwhile.  Callers of bc_fetch look the file size and block up
+ * again once it returns (see file_read and openfile_map).
+ */
+
+#include "fs.h"
+
+#define THREAD_STACKSIZE	(4 * PGSIZE)
+
+struct Thread {
+	uint32_t t_esp;			// saved while the thread is switched out
+	struct ide_req *t_io;		// the disk request it waits for
+	void (*t_fn)(void *);
+	void *t_arg;
+};
+
+static struct Thread threads[NTHREAD];
+static int nthread;
+static uint8_t thread_stacks[NTHREAD][THREAD_STACKSIZE] __attribute__((aligned(16)));
+
+// The thread running now, or -1 in the main context
+static int curthread = -1;
+// The main context's stack pointer while a thread runs
+static uint32_t main_esp;
+
+void thread_switch(uint32_t *save_esp, uint32_t esp);
+
+static void
+thread_start(void)
+{
+	threads[curthread].t_fn(threads[curthread].t_arg);
+	panic("thread %d returned", curthread);
+}
+
+// Create a thread that will call fn(arg) when first run.  Returns the
+// new thread's id.
+int
+thread_create(void (*fn)(void *), void *arg)
+{
+	struct Thread *t;
+	uint32_t *sp;
+
+	if (nthread == NTHREAD)
+		panic("thread_create: too many threads");
+	t = &threads[nthread];
+	t->t_fn = fn;
+	t->t_arg = arg;
+	t->t_io = NULL;
+
+	// Lay out the stack as thread_switch leaves it, so that switching
+	// to it returns into thread_start.
+	sp = (uint32_t *) (thread_stacks[nthread] + THREAD_STACKSIZE);
+	*--sp = 0;			// thread_start's return address
+	*--sp = (uint32_t) thread_start;
+	*--sp = 0;			// %ebp
+	*--sp = 0;			// %ebx
+	*--sp = 0;			// %esi
+	*--sp = 0;			// %edi
+	t->t_esp = (uint32_t) sp;
+	return nthread++;
+}
+
+// Run thread id until it yields.  Called from the main context.
+void
+thread_run(int id)
+{
+	assert(curthread == -1 && id >= 0 && id < nthread);
+	curthread = id;
+	thread_switch(&main_esp, threads[id].t_esp);
+	curthread = -1;
+}
+
+// Switch from the running thread back to the main context.
+void
+thread_yield(void)
+{
+	assert(curthread >= 0);
+	thread_switch(&threads[curthread].t_esp, main_esp);
+}
+
+// Return the id of the running thread, or -1 in the main context.
+int
+thread_self(void)
+{
+	return curthread;
+}
+
+// Can thread id run, or is it still waiting for the disk?
+bool
+thread_ready(int id)
+{
+	return !threads[id].t_io || threads[id].t_io->r_done;
+}
+
+// Wait for the submitted disk request req to complete and return its
+// result.  A thread lets the others run meanwhile; the main context
+// waits as ide_wait does.
+int
+thread_wait_io(struct ide_req *req)
+{
+	struct Thread *t;
+
+	if (curthread < 0)
+		return ide_wait(req);
+	t = &threads[curthread];
+	t->t_io = req;
+	while (!req->r_done)
+		thread_yield();
+	t->t_io = NULL;
+	return req->r_result;
+}
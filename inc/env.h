@@ -44,6 +44,16 @@ enum EnvType {
 	ENV_TYPE_FS,		// File system server
 };
 
+struct Env;
+
+// A FIFO of environments, linked through env_sched_next/env_sched_prev.
+// Used for the per-CPU run queues and the kernel's blocked list.
+struct EnvQueue {
+	struct Env *eq_head;
+	struct Env *eq_tail;
+	uint32_t eq_len;
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -54,6 +64,11 @@ struct Env {
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
 
+	// Scheduling
+	struct Env *env_sched_next;	// Next env on env_sched_queue
+	struct Env *env_sched_prev;	// Previous env on env_sched_queue
+	struct EnvQueue *env_sched_queue; // Queue holding this env, or NULL
+
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 
@@ -66,6 +81,33 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+
+	// Blocking sends.  An env blocked in sys_ipc_send or sys_ipc_call
+	// waits on its target's FIFO of senders with its message saved
+	// here until the target receives.
+	struct Env *env_ipc_senders;	// First sender blocked on us
+	struct Env *env_ipc_senders_tail; // Last sender blocked on us
+	struct Env *env_ipc_send_next;	// Next sender blocked on our target
+	struct Env *env_ipc_send_target; // Env we are blocked on, or NULL
+	uint32_t env_ipc_send_value;	// Pending message
+	void *env_ipc_send_srcva;
+	int env_ipc_send_perm;
+	bool env_ipc_send_call;		// Receive into send_dstva once sent
+	void *env_ipc_send_dstva;
+
+	// A reply sent to us by sys_ipc_reply or sys_ipc_reply_recv while
+	// we were not receiving, for our next receive to deliver.  The
+	// page is held by reference until then.
+	bool env_ipc_reply;
+	envid_t env_ipc_reply_from;
+	uint32_t env_ipc_reply_value;
+	struct PageInfo *env_ipc_reply_page;
+	int env_ipc_reply_perm;
+
+	// Blocked in sys_futex_wait: physical address of the word waited
+	// on (0 if not waiting) and next env on the same hash chain.
+	physaddr_t env_futex_key;
+	struct Env *env_futex_next;
 };
 
 #endif // !JOS_INC_ENV_H
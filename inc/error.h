@@ -25,6 +25,8 @@ enum {
 	E_FILE_EXISTS	,	// File already exists
 	E_NOT_EXEC	,	// File not a valid executable
 	E_NOT_SUPP	,	// Operation not supported
+	E_FILE_BUSY	,	// File is open
+	E_FILE_FRAGMENTED,	// File has too many extents
 
 	MAXERROR
 };
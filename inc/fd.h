@@ -25,6 +25,12 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	// The shared buffer (see FSBUF_PAGES) is used by one env at a
+	// time: the one in buf_owner.  buf_pa is the physical address of
+	// the buffer's last page as the file server has it.
+	volatile uint32_t buf_owner;
+	volatile uint32_t buf_waiting;
+	physaddr_t buf_pa;
 };
 
 struct Fd {
@@ -44,6 +50,9 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// Size of the data area each file descriptor gets (see lib/fd.c)
+#define FDDATASIZE	(16*PGSIZE)
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
@@ -19,28 +19,47 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN	1024
 
-// Number of block pointers in a File descriptor
-#define NDIRECT		10
-// Number of direct block pointers in an indirect block
-#define NINDIRECT	(BLKSIZE / 4)
-
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Number of extents in a File descriptor
+#define NEXTENT		9
+
+// Largest file the extent layout supports.  A file also can't have more
+// than NEXTENT * NBLKEXTENT (9 * 341) extents, one per run of adjacent
+// disk blocks (and fewer once extent blocks are split), so a badly
+// fragmented file fails with -E_FILE_FRAGMENTED before it gets this big.
+#define MAXFILESIZE	0x40000000
+
+// A run of file blocks stored in a run of adjacent disk blocks.
+struct Extent {
+	uint32_t e_fileblk;		// first file block covered
+	uint32_t e_diskblk;		// where it is on disk
+	uint32_t e_len;			// number of blocks
+};
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	// Extents, sorted by file block; blocks no extent covers are
+	// holes.  With f_depth 1, each of f_extent instead points
+	// (e_diskblk) at an ExtentBlock holding the extents from its
+	// e_fileblk up to the next entry's.
+	uint32_t f_depth;
+	uint32_t f_nextent;		// entries of f_extent in use
+	struct Extent f_extent[NEXTENT];
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 16 - sizeof(struct Extent) * NEXTENT];
 } __attribute__((packed));	// required only on some 64-bit machines
 
+// The second level of a file's extents
+#define NBLKEXTENT	((BLKSIZE - 4) / sizeof(struct Extent))
+struct ExtentBlock {
+	uint32_t eb_n;			// extents in use
+	struct Extent eb_ext[NBLKEXTENT];
+};
+
 // An inode block contains exactly BLKFILES 'struct File's
 #define BLKFILES	(BLKSIZE / sizeof(struct File))
 
@@ -48,10 +67,52 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// Directory index.  A directory's File slots never move, since open
+// files point at them, so the index maps the hash of each name to the
+// number of its slot.  It is an extendible hash table stored in the
+// directory file past its slots: a DirIndex header at file block
+// DIRIDX_BLK, followed by the bucket blocks.
+#define DIRIDX_BLK	(MAXFILESIZE / BLKSIZE / 2)
+#define DIRIDX_MAGIC	0x78644944	// 'DIdx'
+#define DIRIDX_MAXDEPTH	9		// so the table fits in one block
+
+struct DirIndex {
+	uint32_t di_magic;		// DIRIDX_MAGIC
+	uint32_t di_depth;		// 1 << di_depth table entries in use
+	uint32_t di_nbucket;		// bucket blocks allocated
+	uint32_t di_freeslot;		// no slot below this one is free
+	uint32_t di_table[1 << DIRIDX_MAXDEPTH];	// hash bits -> bucket
+};
+
+struct DirIndexEnt {
+	uint32_t de_hash;
+	uint32_t de_slot;
+};
+
+// Bucket n is file block DIRIDX_BLK + 1 + n.  It holds the names whose
+// low db_depth hash bits it was split on.
+#define NBUCKETENT	((BLKSIZE - 8) / sizeof(struct DirIndexEnt))
+struct DirBucket {
+	uint32_t db_depth;
+	uint32_t db_n;			// entries in use
+	struct DirIndexEnt db_ent[NBUCKETENT];
+};
+
+// FNV-1a hash of a file name, for the directory index
+static inline uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619U;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
-#define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+#define FS_MAGIC	0x4A0530AF	// related vaguely to 'J\0S!'
 
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
@@ -70,7 +131,54 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read map returns a block cache page as the reply page
+	FSREQ_READ_MAP,
+	// Set buf passes one page of the shared buffer as the request page
+	FSREQ_SETBUF,
+	FSREQ_READV,
+	FSREQ_WRITEV,
+	// Mmap returns a block cache page as the reply page
+	FSREQ_MMAP,
+	FSREQ_MSYNC,
+	// Stats returns a Fsret_stats on the request page
+	FSREQ_STATS
+};
+
+// Each open file can have a buffer of up to FSBUF_PAGES pages shared
+// between the client and the file server, set up one page at a time
+// with FSREQ_SETBUF.  FSREQ_READV and FSREQ_WRITEV then move data
+// between the file and the byte ranges of the buffer named in their
+// iovec list, so a large transfer takes a single request.
+#define FSBUF_PAGES	16
+#define FSBUF_SIZE	(FSBUF_PAGES * PGSIZE)
+#define FSIOV_MAX	32
+
+// Most file blocks one FSREQ_MSYNC can name
+#define FSMSYNC_MAX	((PGSIZE - 2*sizeof(int)) / sizeof(uint32_t))
+
+struct Fsiov {
+	uint32_t iov_off;		// offset in the shared buffer
+	uint32_t iov_len;		// bytes
+};
+
+// Block cache counters, as returned by FSREQ_STATS.
+struct BcStats {
+	uint32_t bc_cap;		// most blocks cached at once
+	uint32_t bc_cached;		// blocks cached now
+	uint32_t bc_hits;		// file block lookups found cached
+	uint32_t bc_misses;		// blocks faulted in from disk
+	uint32_t bc_readahead;		// blocks read ahead of their use
+	uint32_t bc_evictions;		// blocks dropped to make room
+	uint32_t bc_writebacks;		// dirty blocks written by eviction
+};
+
+// Directory entry cache counters, also returned by FSREQ_STATS.
+struct DcStats {
+	uint32_t dc_hits;		// name lookups answered by the cache
+	uint32_t dc_neghits;		// of those, names known to be absent
+	uint32_t dc_misses;		// lookups that searched the directory
+	uint32_t dc_invalidations;	// entries dropped by create/remove
 };
 
 union Fsipc {
@@ -89,6 +197,29 @@ union Fsipc {
 	struct Fsret_read {
 		char ret_buf[PGSIZE];
 	} readRet;
+	struct Fsreq_read_map {
+		int req_fileid;
+		off_t req_offset;
+	} read_map;
+	struct Fsreq_setbuf {
+		int req_fileid;
+		int req_page;		// index of this page in the buffer
+	} setbuf;
+	struct Fsreq_rwv {
+		int req_fileid;
+		int req_niov;
+		struct Fsiov req_iov[FSIOV_MAX];
+	} rwv;
+	struct Fsreq_mmap {
+		int req_fileid;
+		off_t req_offset;
+		int req_write;		// map the page writable
+	} mmap;
+	struct Fsreq_msync {
+		int req_fileid;
+		int req_n;
+		uint32_t req_blocks[FSMSYNC_MAX];	// file block numbers
+	} msync;
 	struct Fsreq_write {
 		int req_fileid;
 		size_t req_n;
@@ -108,6 +239,13 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_stats {
+		uint32_t req_cap;	// new cache cap, or 0 to leave it
+	} stats;
+	struct Fsret_stats {
+		struct BcStats ret_bc;
+		struct DcStats ret_dc;
+	} statsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -48,6 +48,7 @@ envid_t	sys_getenvid(void);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
+envid_t	sys_fork_cow(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
@@ -55,8 +56,20 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(envid_t srcenv, envid_t dstenv,
+		       const struct PageOp *ops, int n, int *errp);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int	sys_ipc_reply(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_futex_wait(volatile uint32_t *va, uint32_t val);
+int	sys_futex_wake(volatile uint32_t *va);
+int	sys_irq_wait(int irq);
+int	sys_irq_bind(int irq);
 
 // This must be inlined.  Exercise for reader: why?
 static inline envid_t __attribute__((always_inline))
@@ -72,12 +85,27 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
+// pagebatch.c
+#define PAGEBATCH_SIZE	32
+struct PageBatch {
+	envid_t pb_srcenv;
+	envid_t pb_dstenv;
+	int pb_n;
+	struct PageOp pb_ops[PAGEBATCH_SIZE];
+};
+void	pagebatch_init(struct PageBatch *b, envid_t srcenv, envid_t dstenv);
+int	pagebatch_add(struct PageBatch *b, int op, void *srcva, void *dstva, int perm);
+int	pagebatch_flush(struct PageBatch *b);
+
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void);
 
 // fd.c
 int	close(int fd);
@@ -95,6 +123,12 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fsstats(uint32_t cap, struct BcStats *st);
+int	fsdcstats(struct DcStats *st);
+ssize_t	read_map(int fd, off_t offset, void *dstva);
+void*	mmap(int fd, off_t offset, size_t len, int prot);
+int	munmap(void *addr);
+int	msync(void *addr, size_t len);
 
 // pageref.c
 int	pageref(void *addr);
@@ -128,4 +162,8 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+
 #endif	// !JOS_INC_LIB_H
@@ -178,6 +178,8 @@ extern volatile pde_t uvpd[];     // VA of current page directory
 struct PageInfo {
 	// Next page on the free list.
 	struct PageInfo *pp_link;
+	// Previous free block on the same buddy free list.
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -185,7 +187,15 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a free buddy block: the block is
+	// 2^pp_order pages long.
+	uint8_t pp_order;
+	uint8_t pp_flags;	// PP_* flags below
 };
 
+#define PP_FREE		0x01	// Page heads a block on a buddy free list
+#define PP_FUTEX	0x02	// An env may be in sys_futex_wait on a word here
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
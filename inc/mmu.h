@@ -69,6 +69,11 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// Software PTE bits with a fixed meaning, shared by the kernel's fork
+// and the user library.
+#define PTE_SHARE	0x400	// Shared with children instead of COW
+#define PTE_COW		0x800	// Copy-on-write
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -89,6 +94,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -96,6 +102,16 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID leaf 1 feature flags (EDX)
+#define CPUID_FEAT_PSE	0x00000008	// Page Size Extensions
+#define CPUID_FEAT_SEP	0x00000800	// SYSENTER/SYSEXIT
+#define CPUID_FEAT_PGE	0x00002000	// Page Global Enable
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// CS for sysenter (SS = CS + 8)
+#define MSR_SYSENTER_ESP	0x175	// Kernel stack pointer for sysenter
+#define MSR_SYSENTER_EIP	0x176	// Kernel entry point for sysenter
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
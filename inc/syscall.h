@@ -16,8 +16,33 @@ enum {
 	SYS_env_set_pgfault_upcall,
 	SYS_yield,
 	SYS_ipc_try_send,
+	SYS_ipc_send,
 	SYS_ipc_recv,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_ipc_reply,
+	SYS_fork_cow,
+	SYS_page_batch,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_irq_wait,
+	SYS_irq_bind,
 	NSYSCALLS
 };
 
+// Operations for SYS_page_batch.  Each one acts on the batch's
+// destination env, as the named system call would.
+enum {
+	PAGEOP_ALLOC = 0,	// sys_page_alloc(dstenv, dstva, perm)
+	PAGEOP_MAP,		// sys_page_map(srcenv, srcva, dstenv, dstva, perm)
+	PAGEOP_UNMAP,		// sys_page_unmap(dstenv, dstva)
+};
+
+struct PageOp {
+	int op;
+	void *srcva;
+	void *dstva;
+	int perm;
+};
+
 #endif /* !JOS_INC_SYSCALL_H */
@@ -248,6 +248,20 @@ read_tsc(void)
 	return tsc;
 }
 
+static inline uint64_t
+rdmsr(uint32_t msr)
+{
+	uint64_t val;
+	asm volatile("rdmsr" : "=A" (val) : "c" (msr));
+	return val;
+}
+
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline uint32_t
 xchg(volatile uint32_t *addr, uint32_t newval)
 {
@@ -261,4 +275,17 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Store newval at addr if it holds old; return what addr held.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t old, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %0"
+		     : "+m" (*addr), "=a" (result)
+		     : "r" (newval), "1" (old)
+		     : "cc", "memory");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -13,6 +13,9 @@
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
 
+// Serializes console output and the input buffer.
+struct spinlock cons_lock = SPINLOCK_INITIALIZER(cons_lock);
+
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
 delay(void)
@@ -406,6 +409,7 @@ cons_intr(int (*proc)(void))
 {
 	int c;
 
+	spin_lock(&cons_lock);
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
 			continue;
@@ -413,6 +417,7 @@ cons_intr(int (*proc)(void))
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
 	}
+	spin_unlock(&cons_lock);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -428,13 +433,15 @@ cons_getc(void)
 	kbd_intr();
 
 	// grab the next character from the input buffer.
+	c = 0;
+	spin_lock(&cons_lock);
 	if (cons.rpos != cons.wpos) {
 		c = cons.buf[cons.rpos++];
 		if (cons.rpos == CONSBUFSIZE)
 			cons.rpos = 0;
-		return c;
 	}
-	return 0;
+	spin_unlock(&cons_lock);
+	return c;
 }
 
 // output a character to the console
@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -17,12 +18,31 @@ enum {
 	CPU_HALTED,
 };
 
+// Free pages are cached per CPU in front of the global free list and
+// moved to and from it PGCACHE_BATCH at a time.  Only the owning CPU
+// uses a cache, except that a CPU about to run out of memory takes the
+// pages back from all of them; pc_lock is for that.
+#define PGCACHE_BATCH	16
+#define PGCACHE_MAX	(4 * PGCACHE_BATCH)
+
+struct PageCache {
+	struct spinlock pc_lock;
+	struct PageInfo *pc_list;       // Cached free pages, via pp_link
+	uint32_t pc_count;              // Number of pages on pc_list
+	uint32_t pc_alloc_hits;         // page_alloc served from pc_list
+	uint32_t pc_alloc_misses;       // page_alloc had to refill pc_list
+	uint32_t pc_free_hits;          // page_free kept the page here
+	uint32_t pc_free_misses;        // page_free had to drain pc_list
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct EnvQueue cpu_runq;       // Runnable envs waiting for this CPU
+	struct PageCache cpu_pgcache;   // Free pages private to this CPU
 };
 
 // Initialized in mpconfig.c
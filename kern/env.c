@@ -14,11 +14,17 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+// Protects envs[], env_free_list, env status and the run queues.
+// env_run and sched_yield are entered with it held and release it
+// on the way out to user mode.
+struct spinlock env_lock = SPINLOCK_INITIALIZER(env_lock);
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -213,6 +219,8 @@ env_setup_vm(struct Env *e)
 //	-E_NO_FREE_ENV if all NENV environments are allocated
 //	-E_NO_MEM on memory exhaustion
 //
+// Must be called with env_lock held.
+//
 int
 env_alloc(struct Env **newenv_store, envid_t parent_id)
 {
@@ -236,7 +244,6 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -272,6 +279,7 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// commit the allocation
 	env_free_list = e->env_link;
+	env_set_status(e, ENV_RUNNABLE);
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -398,6 +406,9 @@ load_icode(struct Env *e, uint8_t *binary)
 		panic("Failed to alloc memory for env!\n");
 	if(page_insert(e->env_pgdir, pp, (void*)(USTACKTOP - PGSIZE), PTE_U | PTE_W) < 0)
 		panic("Failed to map stack at virtual address of env!\n");
+
+	// NOTE: env_run认为cr3中只会是正在运行的env的页目录, 加载完成后切换回去
+	lcr3(PADDR(kern_pgdir));
 }
 
 //
@@ -427,6 +438,7 @@ env_create(uint8_t *binary, enum EnvType type)
 
 //
 // Frees env e and all memory it uses.
+// Must be called with env_lock held.
 //
 void
 env_free(struct Env *e)
@@ -444,8 +456,17 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Fail any sends blocked on e, and stop waiting on e's own target.
+	ipc_env_free(e);
+	futex_env_free(e);
+	irq_env_free(e);
+
+	// Flush all mapped pages in the user portion of the address space.
+	// Syscalls that edit another env's page tables hold pmap_lock and
+	// check env_pgdir, so they see either the whole address space or
+	// none of it.
 	static_assert(UTOP % PTSIZE == 0);
+	spin_lock(&pmap_lock);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
@@ -471,26 +492,48 @@ env_free(struct Env *e)
 	pa = PADDR(e->env_pgdir);
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
+	spin_unlock(&pmap_lock);
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
 
+//
+// Change e's status, moving it between the run queues and the blocked
+// list to match.  All changes to env_status go through here, so that
+// the scheduler never has to look at envs that cannot run.
+// Must be called with env_lock held.
+//
+void
+env_set_status(struct Env *e, unsigned status)
+{
+	sched_dequeue(e);
+	e->env_status = status;
+	if (status == ENV_RUNNABLE)
+		sched_enqueue(e, e == curenv);
+	else if (status == ENV_NOT_RUNNABLE)
+		sched_block(e);
+}
+
 //
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
+// Must be called with env_lock held.  If it returns, the lock is still
+// held; otherwise sched_yield releases it.
+//
 void
 env_destroy(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) &&
+	    curenv != e) {
+		env_set_status(e, ENV_DYING);
 		return;
 	}
 
@@ -526,11 +569,55 @@ env_pop_tf(struct Trapframe *tf)
 	panic("iret failed");  /* mostly to placate the compiler */
 }
 
+//
+// Like env_pop_tf, but leaves the kernel with 'sysexit', which is much
+// cheaper than 'iret'.  sysexit takes the user eip from %edx and esp
+// from %ecx, forces cs and ss to GD_UT and GD_UD, and leaves EFLAGS
+// alone, so EFLAGS are loaded from tf first, without IF (set by sti,
+// which takes effect only after sysexit) or TF.  It is only right for
+// the env that just came in through sysenter_handler: its stub treats
+// %edx and %ecx as clobbered.
+//
+void
+env_sysexit(struct Trapframe *tf)
+{
+	curenv->env_cpunum = cpunum();
+
+	asm volatile(
+		"\tmovl %0,%%esp\n"
+		"\tpopal\n"
+		"\tpopl %%es\n"
+		"\tpopl %%ds\n"
+		"\tmovl 8(%%esp),%%edx\n"	/* tf_eip */
+		"\tmovl 20(%%esp),%%ecx\n"	/* tf_esp */
+		"\tpushl 16(%%esp)\n"	/* tf_eflags */
+		"\tandl %1,(%%esp)\n"
+		"\tpopfl\n"
+		"\tsti\n"		/* takes effect after sysexit */
+		"\tsysexit\n"
+		: : "g" (tf), "i" (~(FL_IF | FL_TF)) : "memory");
+	panic("sysexit failed");  /* mostly to placate the compiler */
+}
+
+//
+// Switch to e's address space.  Kernel mappings are global, so the
+// reload only costs the user half of the TLB, and it is skipped
+// entirely when e's page directory is already loaded (e.g. e yielded
+// and nothing else ran on this CPU).
+//
+static void
+env_load_pgdir(struct Env *e)
+{
+	if (rcr3() != PADDR(e->env_pgdir))
+		lcr3(PADDR(e->env_pgdir));
+}
+
 //
 // Context switch from curenv to env e.
 // Note: if this is the first call to env_run, curenv is NULL.
 //
-// This function does not return.
+// Must be called with env_lock held; releases it once e is committed to
+// this CPU.  This function does not return.
 //
 void
 env_run(struct Env *e)
@@ -556,25 +643,26 @@ env_run(struct Env *e)
 
 	if(curenv == NULL) {
 		curenv = e;
-		curenv->env_status = ENV_RUNNING;
-		lcr3(PADDR(e->env_pgdir));
-		// TODO: 在这里释放锁有问题吗???
-		unlock_kernel();
+		env_set_status(curenv, ENV_RUNNING);
+		env_load_pgdir(e);
+		// NOTE: 必须在lcr3之后释放锁, 否则其他CPU可能释放掉仍被本CPU使用的页目录
+		spin_unlock(&env_lock);
 		// env_pop_tf会从内核态进入用户态执行当前env, 所以在此之前
 		// 需要设置env的状态为ENV_RUNNING
 		env_pop_tf(&curenv->env_tf);
 	}
 
 	// 只有在当前env是运行状态时才修改其状态为可运行
-	if(curenv->env_status == ENV_RUNNING)
-		curenv->env_status = ENV_RUNNABLE;
+	// NOTE: e == curenv时不能放回运行队列, 否则它会同时处于运行态和队列中
+	if(curenv != e && curenv->env_status == ENV_RUNNING)
+		env_set_status(curenv, ENV_RUNNABLE);
 	curenv = e;
-	curenv->env_status = ENV_RUNNING;
+	env_set_status(curenv, ENV_RUNNING);
 	curenv->env_runs += 1; // TODO: 这里是加1处理吗???
-	lcr3(PADDR(e->env_pgdir));
+	env_load_pgdir(e);
 
-	// TODO: 在这里释放锁有问题吗???
-	unlock_kernel();
+	// NOTE: 必须在lcr3之后释放锁, 否则其他CPU可能释放掉仍被本CPU使用的页目录
+	spin_unlock(&env_lock);
 	// 通过模拟iret切换到用户态执行
 	env_pop_tf(&e->env_tf);
 	// panic("env_run not yet implemented");
@@ -81,9 +81,9 @@ i386_init(void)
 	// Lab 4 multitasking initialization functions
 	pic_init();
 
-	// Acquire the big kernel lock before waking up APs
-	// Your code here:
-	lock_kernel();
+	// Hold env_lock while creating the first envs, so that the APs
+	// wait in sched_yield until there is something to run.
+	spin_lock(&env_lock);
 
 	// Starting non-boot CPUs
 	boot_aps();
@@ -143,7 +143,7 @@ void
 mp_main(void)
 {
 	// We are in high EIP now, safe to switch to kern_pgdir 
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
 	lapic_init();
@@ -156,7 +156,7 @@ mp_main(void)
 	// only one CPU can enter the scheduler at a time!
 	//
 	// Your code here:
-	lock_kernel();
+	spin_lock(&env_lock);
 	sched_yield();
 
 	// Remove this after you finish Exercise 6
@@ -11,6 +11,8 @@
 #include <kern/monitor.h>
 #include <kern/kdebug.h>
 #include <kern/trap.h>
+#include <kern/cpu.h>
+#include <kern/pmap.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -26,6 +28,8 @@ static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "monbacktrace", "Display information about backtrace", mon_backtrace},
+	{ "pgcache", "Display per-CPU page cache statistics", mon_pgcache },
+	{ "buddyinfo", "Display free physical memory by block size", mon_buddyinfo },
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -73,6 +77,50 @@ mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 }
 
 
+int
+mon_pgcache(int argc, char **argv, struct Trapframe *tf)
+{
+	struct PageCache *pc;
+	uint32_t hits, total;
+	int i;
+
+	cprintf("cpu cached  alloc-hit alloc-miss   free-hit  free-miss  hit%%\n");
+	for (i = 0; i < ncpu; i++) {
+		pc = &cpus[i].cpu_pgcache;
+		hits = pc->pc_alloc_hits + pc->pc_free_hits;
+		total = hits + pc->pc_alloc_misses + pc->pc_free_misses;
+		cprintf("%3d %6d %10u %10u %10u %10u  %3d\n", i, pc->pc_count,
+			pc->pc_alloc_hits, pc->pc_alloc_misses,
+			pc->pc_free_hits, pc->pc_free_misses,
+			total ? (int) ((uint64_t) hits * 100 / total) : 0);
+	}
+	return 0;
+}
+
+int
+mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
+{
+	size_t nblocks[PAGE_MAX_ORDER + 1], nfree = 0, nbig = 0;
+	int k, largest = -1;
+
+	page_free_stats(nblocks);
+	cprintf("order  block   free blocks\n");
+	for (k = 0; k <= PAGE_MAX_ORDER; k++) {
+		cprintf("%5d %5dK %13u\n", k, 4 << k, nblocks[k]);
+		nfree += nblocks[k] << k;
+		if (nblocks[k])
+			largest = k;
+	}
+	// Pages that could satisfy a 4MB (large page) request.
+	nbig = nblocks[PAGE_MAX_ORDER] << PAGE_MAX_ORDER;
+	cprintf("free: %u pages (%uK), largest block: order %d\n",
+		nfree, nfree * 4, largest);
+	cprintf("fragmentation: %u%% of free memory is outside order-%d blocks\n",
+		nfree ? (uint32_t) ((uint64_t) (nfree - nbig) * 100 / nfree) : 0,
+		PAGE_MAX_ORDER);
+	return 0;
+}
+
 
 /***** Kernel monitor command interpreter *****/
 
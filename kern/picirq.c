@@ -84,3 +84,12 @@ irq_setmask_8259A(uint16_t mask)
 	cprintf("\n");
 }
 
+
+// Acknowledge 'irq'.  The master runs in automatic EOI mode, but the
+// slave needs an explicit end-of-interrupt.
+void
+irq_eoi_8259A(int irq)
+{
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+}
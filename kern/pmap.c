@@ -18,7 +18,31 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Buddy allocator: free_area[k] lists the free blocks of 2^k pages,
+// linked through pp_link/pp_prev of each block's first page.
+static struct FreeArea {
+	struct PageInfo *fa_list;
+	size_t fa_nblocks;
+} free_area[PAGE_MAX_ORDER + 1];
+
+// See kern/spinlock.h for the locking order.
+struct spinlock pmap_lock = SPINLOCK_INITIALIZER(pmap_lock);
+static struct spinlock page_lock = SPINLOCK_INITIALIZER(page_lock);
+
+// Whether page_alloc/page_free go through the per-CPU page caches.
+// Off while mem_init's checks need exact control over free pages.
+static bool pgcache_enabled;
+
+// Whether the CPU supports 4MB pages.  If so, the KERNBASE direct map
+// is built from large page directory entries instead of page tables.
+static bool pse_enabled;
+
+// Whether the CPU supports global pages.  Kernel mappings above UTOP
+// (except UVPT, which differs per env) are then marked PTE_G so they
+// survive the TLB flush on every lcr3.
+static bool pge_enabled;
+#define PTE_KERN_G	(pge_enabled ? PTE_G : 0)
 
 
 // --------------------------------------------------------------
@@ -64,6 +88,7 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
+static void page_init_highmem(void);
 static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
@@ -83,7 +108,7 @@ static void check_page_installed_pgdir(void);
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 // Note that when this function is called, we are still using entry_pgdir,
 // which only maps the first 4MB of physical memory.
 static void *
@@ -135,12 +160,22 @@ boot_alloc(uint32_t n)
 void
 mem_init(void)
 {
-	uint32_t cr0;
+	uint32_t cr0, edx;
 	size_t n;
+	int i;
 
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+#ifndef JOS_NO_PSE
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pse_enabled = (edx & CPUID_FEAT_PSE) != 0;
+#endif
+#ifndef JOS_NO_PGE
+	cpuid(1, NULL, NULL, NULL, &edx);
+	pge_enabled = (edx & CPUID_FEAT_PGE) != 0;
+#endif
+
 	// Remove this line when you're ready to test this function.
 	// panic("mem_init: This function is not finished\n");
 
@@ -183,7 +218,7 @@ mem_init(void)
 	// memory management will go through the page_* functions. In
 	// particular, we can now map memory using boot_map_region
 	// or page_insert
-	// NOTE: 在分配完pages和envs需要的页面之后对page_free_list进行初始化
+	// NOTE: 在分配完pages和envs需要的页面之后对空闲页面进行初始化
 	page_init();
 
 	check_page_free_list(1);
@@ -200,7 +235,7 @@ mem_init(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, UPAGES, ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE), PADDR(pages), PTE_U);
+	boot_map_region(kern_pgdir, UPAGES, ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE), PADDR(pages), PTE_U | PTE_KERN_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -210,7 +245,7 @@ mem_init(void)
 	//    - envs itself -- kernel RW, user NONE
 	// LAB 3: Your code here.
 	// NOTE: 必须正确设置页表的权限, 否则用户进程在访问内存会出现page fault
-	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U);
+	boot_map_region(kern_pgdir, UENVS, ROUNDUP(NENV * sizeof(struct Env), PGSIZE), PADDR(envs), PTE_U | PTE_KERN_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -223,7 +258,7 @@ mem_init(void)
 	//       overwrite memory.  Known as a "guard page".
 	//     Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W);
+	boot_map_region(kern_pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | PTE_KERN_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -233,7 +268,9 @@ mem_init(void)
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
 	// Your code goes here:
-	boot_map_region(kern_pgdir, KERNBASE, 0xffffffff - KERNBASE + 1, 0, PTE_W);
+	// NOTE: CPU支持PSE时用4MB大页映射, 省去64个页表页, 也减少TLB缺失
+	boot_map_region(kern_pgdir, KERNBASE, 0xffffffff - KERNBASE + 1, 0,
+			PTE_W | PTE_KERN_G | (pse_enabled ? PTE_PS : 0));
 
 	// Initialize the SMP-related parts of the memory map
 	mem_init_mp();
@@ -248,7 +285,11 @@ mem_init(void)
 	//
 	// If the machine reboots at this point, you've probably set up your
 	// kern_pgdir wrong.
-	lcr3(PADDR(kern_pgdir));
+	mem_init_percpu();
+
+	// All of physical memory is mapped now; hand the rest of it to
+	// the allocator.
+	page_init_highmem();
 
 	check_page_free_list(0);
 
@@ -261,6 +302,25 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	// The checks are done; let the per-CPU caches take over order 0.
+	for (i = 0; i < NCPU; i++)
+		spin_initlock(&cpus[i].cpu_pgcache.pc_lock);
+	pgcache_enabled = true;
+}
+
+// Enable the paging features kern_pgdir relies on and switch to it.
+// Called on every CPU.
+void
+mem_init_percpu(void)
+{
+	// Large PDEs are only honoured once CR4.PSE is set, so this must
+	// happen before kern_pgdir is loaded.
+	if (pse_enabled)
+		lcr4(rcr4() | CR4_PSE);
+	if (pge_enabled)
+		lcr4(rcr4() | CR4_PGE);
+	lcr3(PADDR(kern_pgdir));
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -289,21 +349,104 @@ mem_init_mp(void)
 	for(int i = 0; i < NCPU; ++i) {
 		uint32_t kstacktop_i = KSTACKTOP - i * (KSTKSIZE + KSTKGAP);
 		uint32_t pa = PADDR(percpu_kstacks[i]);
-		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, pa, PTE_W);
+		boot_map_region(kern_pgdir, kstacktop_i - KSTKSIZE, KSTKSIZE, pa, PTE_W | PTE_KERN_G);
 	}
 }
 
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy
+// allocator in blocks of 2^order pages.
 // --------------------------------------------------------------
 
+static void
+buddy_push(struct PageInfo *pp, int order)
+{
+	struct FreeArea *fa = &free_area[order];
+
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	pp->pp_prev = NULL;
+	pp->pp_link = fa->fa_list;
+	if (fa->fa_list)
+		fa->fa_list->pp_prev = pp;
+	fa->fa_list = pp;
+	fa->fa_nblocks++;
+}
+
+static void
+buddy_remove(struct PageInfo *pp)
+{
+	struct FreeArea *fa = &free_area[pp->pp_order];
+
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		fa->fa_list = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	fa->fa_nblocks--;
+	pp->pp_flags &= ~PP_FREE;
+	pp->pp_link = pp->pp_prev = NULL;
+}
+
+//
+// Take a block of 2^order pages, splitting a larger block if needed.
+// Caller must hold page_lock.
+//
+static struct PageInfo *
+buddy_alloc(int order)
+{
+	struct PageInfo *pp;
+	int k;
+
+	for (k = order; k <= PAGE_MAX_ORDER && !free_area[k].fa_list; k++)
+		/* do nothing */;
+	if (k > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = free_area[k].fa_list;
+	buddy_remove(pp);
+	// Give back the upper halves we don't need.
+	while (k > order) {
+		k--;
+		buddy_push(pp + (1 << k), k);
+	}
+	return pp;
+}
+
+//
+// Return a block of 2^order pages, merging it with its buddy for as
+// long as the buddy is free too.  Caller must hold page_lock.
+//
+static void
+buddy_free(struct PageInfo *pp, int order)
+{
+	size_t ppn = pp - pages, buddy;
+
+	while (order < PAGE_MAX_ORDER) {
+		buddy = ppn ^ (1 << order);
+		if (buddy + (1 << order) > npages ||
+		    !(pages[buddy].pp_flags & PP_FREE) ||
+		    pages[buddy].pp_order != order)
+			break;
+		buddy_remove(&pages[buddy]);
+		ppn &= ~(size_t) (1 << order);
+		order++;
+	}
+	buddy_push(&pages[ppn], order);
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory.
+//
+// Only pages in the first 4MB are handed to the allocator here, since
+// entry_pgdir maps nothing else; page_init_highmem adds the rest once
+// kern_pgdir is loaded.
 //
 void
 page_init(void)
@@ -342,12 +485,83 @@ page_init(void)
 		// 空闲的物理页面
 		else {
 			pages[i].pp_ref = 0;
-			pages[i].pp_link = page_free_list;
-			page_free_list = &pages[i];
+			pages[i].pp_link = NULL;
+			if(i < NPTENTRIES)
+				buddy_free(&pages[i], 0);
 		}
 	}
 }
 
+//
+// Give the free pages above 4MB to the allocator.
+//
+static void
+page_init_highmem(void)
+{
+	size_t i;
+
+	for (i = NPTENTRIES; i < npages; i++)
+		if (pages[i].pp_ref == 0 && !(pages[i].pp_flags & PP_FREE))
+			buddy_free(&pages[i], 0);
+}
+
+//
+// Move up to PGCACHE_BATCH pages from the buddy allocator to this CPU's
+// cache.  Must be called with pc->pc_lock held, as must pgcache_drain.
+//
+static void
+pgcache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < PGCACHE_BATCH && (pp = buddy_alloc(0)); i++) {
+		pp->pp_link = pc->pc_list;
+		pc->pc_list = pp;
+		pc->pc_count++;
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Give up to n pages from a CPU's cache back to the buddy allocator.
+//
+static void
+pgcache_drain(struct PageCache *pc, int n)
+{
+	struct PageInfo *pp;
+	int i;
+
+	spin_lock(&page_lock);
+	for (i = 0; i < n && (pp = pc->pc_list); i++) {
+		pc->pc_list = pp->pp_link;
+		pc->pc_count--;
+		pp->pp_link = NULL;
+		buddy_free(pp, 0);
+	}
+	spin_unlock(&page_lock);
+}
+
+//
+// Give every page in every CPU's cache back to the buddy allocator, so
+// that an allocation that found the buddy allocator empty, or too
+// fragmented, can try again.  Must be called without any pc_lock held.
+//
+static void
+pgcache_reclaim(void)
+{
+	struct PageCache *pc;
+	int i;
+
+	for (i = 0; i < NCPU; i++) {
+		pc = &cpus[i].cpu_pgcache;
+		spin_lock(&pc->pc_lock);
+		pgcache_drain(pc, pc->pc_count);
+		spin_unlock(&pc->pc_lock);
+	}
+}
+
 //
 // Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
 // returned physical page with '\0' bytes.  Does NOT increment the reference
@@ -364,14 +578,43 @@ struct PageInfo *
 page_alloc(int alloc_flags)
 {
 	// Fill this function in
-	// NOTE: 在page_free_list中找一个空闲的物理页面分配出去
-	// Out of memory
-	if(page_free_list == NULL)
-		return 0;
-
-	// 取出第一个空闲页面
-	struct PageInfo *new_free = page_free_list->pp_link;
-	struct PageInfo *old_free = page_free_list;
+	// NOTE: 优先从本CPU的缓存中分配, 缓存为空时从伙伴系统批量补充
+	struct PageInfo *old_free;
+
+	if(pgcache_enabled) {
+		// NOTE: 内核中中断是关闭的, 本CPU的缓存只有在内存耗尽时才会被其他CPU访问,
+		// 所以pc_lock几乎不会有竞争
+		struct PageCache *pc = &thiscpu->cpu_pgcache;
+		spin_lock(&pc->pc_lock);
+		if(pc->pc_list == NULL) {
+			pc->pc_alloc_misses++;
+			pgcache_refill(pc);
+			// NOTE: 伙伴系统也空了, 收回所有CPU缓存中的页面再试一次
+			if(pc->pc_list == NULL) {
+				spin_unlock(&pc->pc_lock);
+				pgcache_reclaim();
+				spin_lock(&pc->pc_lock);
+				pgcache_refill(pc);
+			}
+		} else
+			pc->pc_alloc_hits++;
+
+		// Out of memory
+		if((old_free = pc->pc_list) == NULL) {
+			spin_unlock(&pc->pc_lock);
+			return 0;
+		}
+		pc->pc_list = old_free->pp_link;
+		pc->pc_count--;
+		spin_unlock(&pc->pc_lock);
+	} else {
+		spin_lock(&page_lock);
+		old_free = buddy_alloc(0);
+		spin_unlock(&page_lock);
+		// Out of memory
+		if(old_free == NULL)
+			return 0;
+	}
 	old_free->pp_link = NULL; // 页面已经被分配出去, 从空闲列表中移除
 
 	// 根据需要清空页面
@@ -379,11 +622,10 @@ page_alloc(int alloc_flags)
 	// 实际操作发现, 当把qemu的物理内存设置成4G大小时, 管理这些页面需要的pages数据
 	// 结构会超过最初设置的临时页表的管理范围, 在启动过程中产生缺页中断, 系统死机
 	// NOTE: 物理内存的一个页面在内核的虚地址空间中一定可以找到一个对应的页面
+	// NOTE: 清零放在锁外面, 避免其他CPU等待
 	if(alloc_flags & ALLOC_ZERO)
 		memset(page2kva(old_free), 0, PGSIZE);
 
-	// 更新空闲页面列表
-	page_free_list = new_free;
 	return old_free;
 }
 
@@ -398,10 +640,97 @@ page_free(struct PageInfo *pp)
 	// Hint: You may want to panic if pp->pp_ref is nonzero or
 	// pp->pp_link is not NULL.
 	// NOTE: 回收空闲的物理页面
-	if(pp->pp_ref != 0 || pp->pp_link != NULL)
+	if(pp->pp_ref != 0 || pp->pp_link != NULL || (pp->pp_flags & PP_FREE))
 		panic("Failed to do a page_free!\n");
-	pp->pp_link = page_free_list;
-	page_free_list = pp;
+	pp->pp_flags &= ~PP_FUTEX;
+
+	if(pgcache_enabled) {
+		struct PageCache *pc = &thiscpu->cpu_pgcache;
+		spin_lock(&pc->pc_lock);
+		pp->pp_link = pc->pc_list;
+		pc->pc_list = pp;
+		if(++pc->pc_count > PGCACHE_MAX) {
+			pc->pc_free_misses++;
+			pgcache_drain(pc, PGCACHE_BATCH);
+		} else
+			pc->pc_free_hits++;
+		spin_unlock(&pc->pc_lock);
+		return;
+	}
+
+	spin_lock(&page_lock);
+	buddy_free(pp, 0);
+	spin_unlock(&page_lock);
+}
+
+//
+// Allocates 2^order physically contiguous pages, aligned to their size,
+// and returns the first one.  Each page is reference counted on its own,
+// as if it came from page_alloc; ALLOC_ZERO clears all of them.
+//
+// Returns NULL if no free block is large enough.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	if (order == 0)
+		return page_alloc(alloc_flags);
+
+	spin_lock(&page_lock);
+	pp = buddy_alloc(order);
+	spin_unlock(&page_lock);
+	if (!pp && pgcache_enabled) {
+		// Cached pages may be what keeps a block from merging.
+		pgcache_reclaim();
+		spin_lock(&page_lock);
+		pp = buddy_alloc(order);
+		spin_unlock(&page_lock);
+	}
+	if (pp && (alloc_flags & ALLOC_ZERO))
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block from page_alloc_order.  The pages may also be freed
+// one at a time with page_free; the allocator merges them again.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	int i;
+
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	if (order == 0) {
+		page_free(pp);
+		return;
+	}
+
+	for (i = 0; i < (1 << order); i++)
+		if (pp[i].pp_ref != 0 || pp[i].pp_link != NULL ||
+		    (pp[i].pp_flags & PP_FREE))
+			panic("page_free_order: page %d of block is in use", i);
+	spin_lock(&page_lock);
+	buddy_free(pp, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Store the number of free blocks of each order in nblocks[].
+// Pages held in the per-CPU caches are not included.
+//
+void
+page_free_stats(size_t nblocks[PAGE_MAX_ORDER + 1])
+{
+	int k;
+
+	spin_lock(&page_lock);
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+		nblocks[k] = free_area[k].fa_nblocks;
+	spin_unlock(&page_lock);
 }
 
 //
@@ -445,6 +774,9 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 	// 计算va对应的页目录表和页表索引
 	uint32_t pd_index = PDX(va);
 	uint32_t pt_index = PTX(va);
+	// NOTE: 4MB大页没有页表, 直接返回页目录项本身
+	if(pgdir[pd_index] & PTE_PS)
+		return &pgdir[pd_index];
 	if(create) {
 		// 页目录表项为空
 		if((pgdir[pd_index] & PTE_P) == 0) {
@@ -484,6 +816,19 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm
 	assert(va % PGSIZE == 0);
 	assert(pa % PGSIZE == 0);
 
+	// NOTE: 使用4MB大页时直接填写页目录项
+	if(perm & PTE_PS) {
+		assert(size % PTSIZE == 0);
+		assert(va % PTSIZE == 0);
+		assert(pa % PTSIZE == 0);
+		for(size_t i = 0; i < size; i += PTSIZE) {
+			pgdir[PDX(va)] = (pa | perm | PTE_P);
+			va += PTSIZE;
+			pa += PTSIZE;
+		}
+		return;
+	}
+
 	// Fill this function in
 	for(size_t i = 0; i < size; i += PGSIZE) {
 		pte_t *pte = pgdir_walk(pgdir, (void *)va, 1);
@@ -567,6 +912,9 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 
 	// 获取PageInfo
 	physaddr_t pa = PTE_ADDR(*pte);
+	// NOTE: pte是4MB大页的页目录项时, 还要加上页在大页中的偏移
+	if(*pte & PTE_PS)
+		pa = (pa & ~(PTSIZE - 1)) | (PTX(va) << PTXSHIFT);
 	struct PageInfo *page_info = pa2page(pa);
 	return page_info;
 }
@@ -620,6 +968,47 @@ tlb_invalidate(pde_t *pgdir, void *va)
 		invlpg(va);
 }
 
+//
+// Copy the user mappings in [0, end) of 'src' into 'dst' for fork.
+// Writable and copy-on-write pages become copy-on-write in both;
+// PTE_SHARE and read-only pages are mapped as they are.  Works on
+// whole page tables at a time instead of one page_insert per page.
+// The caller must flush the TLB for 'src' afterwards.
+//
+// Must be called with pmap_lock held.
+// Returns 0 on success, -E_NO_MEM if a page table can't be allocated.
+//
+int
+pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t end)
+{
+	uint32_t pdeno, pteno;
+	pte_t *spt, *dpt, pte;
+
+	assert(end <= UTOP && end % PGSIZE == 0);
+	for (pdeno = 0; pdeno < PDX(end - 1) + 1; pdeno++) {
+		if (!(src[pdeno] & PTE_P))
+			continue;
+		spt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+		if (!(dpt = pgdir_walk(dst, PGADDR(pdeno, 0, 0), 1)))
+			return -E_NO_MEM;
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if ((uintptr_t) PGADDR(pdeno, pteno, 0) >= end)
+				break;
+			pte = spt[pteno];
+			if ((pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+				continue;
+			pte &= ~0xfff | PTE_SYSCALL;
+			if (!(pte & PTE_SHARE) && (pte & (PTE_W|PTE_COW))) {
+				pte = (pte & ~PTE_W) | PTE_COW;
+				spt[pteno] = pte;
+			}
+			dpt[pteno] = pte;
+			pa2page(PTE_ADDR(pte))->pp_ref++;
+		}
+	}
+	return 0;
+}
+
 //
 // Reserve size bytes in the MMIO region and map [pa,pa+size) at this
 // location.  Return the base of the reserved region.  size does *not*
@@ -659,7 +1048,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	}
 
 	size = ROUNDUP(size, PGSIZE);
-	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD|PTE_PWT|PTE_W);
+	boot_map_region(kern_pgdir, base, size, pa, PTE_PCD|PTE_PWT|PTE_W|PTE_KERN_G);
 	base += size;
 
 	return (void*)(base - size);
@@ -668,6 +1057,32 @@ mmio_map_region(physaddr_t pa, size_t size)
 
 static uintptr_t user_mem_check_addr;
 
+// user_mem_check, with pmap_lock already held.
+static int
+user_mem_check_locked(struct Env *env, const void *va, size_t len, int perm)
+{
+	// 试图访问内核的地址空间
+	if((uint32_t)va >= KERNBASE) {
+		user_mem_check_addr = (uint32_t)va;
+		return -E_FAULT;
+	}
+
+	uint32_t va_s = (uint32_t)ROUNDDOWN(va, PGSIZE);
+	uint32_t va_e = (uint32_t)ROUNDUP(va + len, PGSIZE);
+
+	for(; va_s < va_e; va_s += PGSIZE) {
+		pte_t *pte = pgdir_walk(env->env_pgdir, (void *)va_s, 0);
+		// NOTE: 要求perm中的每一位都被设置, 而不是其中任意一位
+		if(pte == NULL || (((*pte) & (perm | PTE_P)) != (perm | PTE_P))) {
+			// NOTE: ?:表达式, :两边的表达式类型必须一致, 这样整个表达式的类型才能确定
+			// 否则编译器会不知所措:P
+			user_mem_check_addr = (va_s < (uint32_t)va ? (uint32_t)va : va_s);
+			return -E_FAULT;
+		}
+	}
+	return 0;
+}
+
 //
 // Check that an environment is allowed to access the range of memory
 // [va, va+len) with permissions 'perm | PTE_P'.
@@ -690,27 +1105,22 @@ int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
 	// LAB 3: Your code here.
+	int r;
 
-	// 试图访问内核的地址空间
-	if((uint32_t)va >= KERNBASE) {
-		user_mem_check_addr = (uint32_t)va;
-		return -E_FAULT;
-	}
-
-	uint32_t va_s = (uint32_t)ROUNDDOWN(va, PGSIZE);
-	uint32_t va_e = (uint32_t)ROUNDUP(va + len, PGSIZE);
-
-	for(; va_s < va_e; va_s += PGSIZE) {
-		pte_t *pte = pgdir_walk(env->env_pgdir, (void *)va_s, 0);
-		if(pte == NULL || (((*pte) & (perm | PTE_P)) == 0)) {
-			// NOTE: ?:表达式, :两边的表达式类型必须一致, 这样整个表达式的类型才能确定
-			// 否则编译器会不知所措:P
-			user_mem_check_addr = (va_s < (uint32_t)va ? (uint32_t)va : va_s);
-			return -E_FAULT;
-		}
-	}
+	spin_lock(&pmap_lock);
+	r = user_mem_check_locked(env, va, len, perm);
+	spin_unlock(&pmap_lock);
+	return r;
+}
 
-	return 0;
+static void
+user_mem_fail(struct Env *env)
+{
+	cprintf("[%08x] user_mem_check assertion failure for "
+		"va %08x\n", env->env_id, user_mem_check_addr);
+	spin_lock(&env_lock);
+	env_destroy(env);	// may not return
+	spin_unlock(&env_lock);
 }
 
 //
@@ -723,11 +1133,47 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 void
 user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 {
-	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
-		cprintf("[%08x] user_mem_check assertion failure for "
-			"va %08x\n", env->env_id, user_mem_check_addr);
-		env_destroy(env);	// may not return
-	}
+	if (user_mem_check(env, va, len, perm | PTE_U) < 0)
+		user_mem_fail(env);
+}
+
+//
+// Copy [va, va+len) of the current environment 'env' into the kernel
+// buffer 'dst', or 'src' out to it, checking the range as
+// user_mem_assert does.  pmap_lock is held across the check and the
+// copy, so another CPU running an env that shares the address space
+// cannot unmap the pages in between.  Returns 0 if the copy was made;
+// otherwise 'env' is destroyed and, being curenv, the call does not
+// return.
+//
+int
+user_mem_copyin(struct Env *env, void *dst, const void *va, size_t len)
+{
+	int r;
+
+	assert(env == curenv);
+	spin_lock(&pmap_lock);
+	if ((r = user_mem_check_locked(env, va, len, PTE_U)) == 0)
+		memmove(dst, va, len);
+	spin_unlock(&pmap_lock);
+	if (r < 0)
+		user_mem_fail(env);
+	return r;
+}
+
+int
+user_mem_copyout(struct Env *env, void *va, const void *src, size_t len)
+{
+	int r;
+
+	assert(env == curenv);
+	spin_lock(&pmap_lock);
+	if ((r = user_mem_check_locked(env, va, len, PTE_U | PTE_W)) == 0)
+		memmove(va, src, len);
+	spin_unlock(&pmap_lock);
+	if (r < 0)
+		user_mem_fail(env);
+	return r;
 }
 
 
@@ -736,46 +1182,95 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Allocate every free page, linking them through pp_link, so that a
+// check can run against an empty allocator.
+//
+static struct PageInfo *
+check_steal_free_pages(void)
+{
+	struct PageInfo *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0))) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+//
+// Give back the pages taken by check_steal_free_pages.
 //
 static void
-check_page_free_list(bool only_low_memory)
+check_return_free_pages(struct PageInfo *fl)
 {
 	struct PageInfo *pp;
+
+	while ((pp = fl)) {
+		fl = pp->pp_link;
+		pp->pp_link = NULL;
+		page_free(pp);
+	}
+}
+
+//
+// Number of free pages in the buddy allocator.
+//
+static size_t
+check_nfree(void)
+{
+	size_t nblocks[PAGE_MAX_ORDER + 1], n = 0;
+	int k;
+
+	page_free_stats(nblocks);
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+		n += nblocks[k] << k;
+	return n;
+}
+
+//
+// Check that the pages on the buddy free lists are reasonable.
+//
+static void
+check_page_free_list(bool only_low_memory)
+{
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int k, i;
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	if (check_nfree() == 0)
+		panic("the page allocator has no free pages!");
+
+	// page_init only gave low memory to the allocator, since
+	// entry_pgdir does not map all pages.
+	if (only_low_memory)
+		for (k = 0; k <= PAGE_MAX_ORDER; k++)
+			for (blk = free_area[k].fa_list; blk; blk = blk->pp_link)
+				assert(PDX(page2pa(blk + (1 << k) - 1)) < pdx_limit);
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+		for (blk = free_area[k].fa_list; blk; blk = blk->pp_link)
+			for (pp = blk; pp < blk + (1 << k); pp++)
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
+	for (k = 0; k <= PAGE_MAX_ORDER; k++)
+	for (blk = free_area[k].fa_list; blk; blk = blk->pp_link)
+	for (i = 0; i < (1 << k); i++) {
+		pp = blk + i;
+
 		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+		assert(blk >= pages);
+		assert(blk + (1 << k) <= pages + npages);
+		assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+		assert((blk - pages) % (1 << k) == 0);
+		assert(blk->pp_flags & PP_FREE);
+		assert(blk->pp_order == k);
+		assert(pp->pp_ref == 0);
 
 		// check a few pages that shouldn't be on the free list
 		assert(page2pa(pp) != 0);
@@ -815,8 +1310,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = check_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -832,8 +1326,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -861,7 +1354,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -869,9 +1362,23 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(check_nfree() == nfree);
+
+	// multi-page blocks are aligned to their size, and freeing them
+	// (all at once or page by page) merges them back
+	assert((pp0 = page_alloc_order(3, ALLOC_ZERO)));
+	assert((pp0 - pages) % 8 == 0);
+	c = page2kva(pp0);
+	for (i = 0; i < 8 * PGSIZE; i++)
+		assert(c[i] == 0);
+	assert((pp1 = page_alloc_order(2, 0)));
+	assert((pp1 - pages) % 4 == 0);
+	assert(pp1 + 4 <= pp0 || pp1 >= pp0 + 8);
+	assert(check_nfree() == nfree - 12);
+	page_free_order(pp0, 3);
+	for (i = 0; i < 4; i++)
+		page_free(pp1 + i);
+	assert(check_nfree() == nfree);
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -931,6 +1438,7 @@ check_kern_pgdir(void)
 			if (i >= PDX(KERNBASE)) {
 				assert(pgdir[i] & PTE_P);
 				assert(pgdir[i] & PTE_W);
+				assert(!!(pgdir[i] & PTE_PS) == pse_enabled);
 			} else
 				assert(pgdir[i] == 0);
 			break;
@@ -952,6 +1460,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) | (PTX(va) << PTXSHIFT);
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -982,8 +1492,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1103,7 +1612,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -8,6 +8,7 @@
 
 #include <inc/memlayout.h>
 #include <inc/assert.h>
+#include <kern/spinlock.h>
 struct Env;
 
 extern char bootstacktop[], bootstack[];
@@ -17,6 +18,11 @@ extern size_t npages;
 
 extern pde_t *kern_pgdir;
 
+// Protects user page tables and pp_ref.  Callers take it around
+// page_insert/page_remove/page_lookup/pgdir_walk on user address spaces;
+// page_alloc and page_free do their own locking.
+extern struct spinlock pmap_lock;
+
 
 /* This macro takes a kernel virtual address -- an address that points above
  * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
@@ -52,21 +58,32 @@ enum {
 };
 
 void	mem_init(void);
+void	mem_init_percpu(void);
 
 void	page_init(void);
+// The physical page allocator hands out blocks of 2^order pages,
+// 0 <= order <= PAGE_MAX_ORDER, aligned to their size.
+#define PAGE_MAX_ORDER	10
+
 struct PageInfo *page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_free_stats(size_t nblocks[PAGE_MAX_ORDER + 1]);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+int	pgdir_copy_cow(pde_t *dst, pde_t *src, uintptr_t end);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
+int	user_mem_copyin(struct Env *env, void *dst, const void *va, size_t len);
+int	user_mem_copyout(struct Env *env, void *va, const void *src, size_t len);
 
 static inline physaddr_t
 page2pa(struct PageInfo *pp)
@@ -5,6 +5,8 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +18,17 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
+	bool locked;
 
+	// Keep each message in one piece when several CPUs print at
+	// once.  Don't risk deadlocking a panic message on the lock.
+	if ((locked = !panicstr))
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locked)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
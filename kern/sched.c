@@ -7,48 +7,125 @@
 
 void sched_halt(void);
 
+// Envs that are ENV_NOT_RUNNABLE (blocked in ipc_recv, freshly
+// exofork'ed, ...).  They are kept off the run queues so that
+// picking the next env never has to step over them.
+static struct EnvQueue blocked_envs;
+
+static void
+envq_push(struct EnvQueue *q, struct Env *e)
+{
+	assert(e->env_sched_queue == NULL);
+	e->env_sched_queue = q;
+	e->env_sched_next = NULL;
+	e->env_sched_prev = q->eq_tail;
+	if (q->eq_tail)
+		q->eq_tail->env_sched_next = e;
+	else
+		q->eq_head = e;
+	q->eq_tail = e;
+	q->eq_len++;
+}
+
+static void
+envq_remove(struct Env *e)
+{
+	struct EnvQueue *q = e->env_sched_queue;
+
+	if (e->env_sched_prev)
+		e->env_sched_prev->env_sched_next = e->env_sched_next;
+	else
+		q->eq_head = e->env_sched_next;
+	if (e->env_sched_next)
+		e->env_sched_next->env_sched_prev = e->env_sched_prev;
+	else
+		q->eq_tail = e->env_sched_prev;
+	q->eq_len--;
+	e->env_sched_queue = NULL;
+	e->env_sched_next = e->env_sched_prev = NULL;
+}
+
+static struct Env *
+envq_pop(struct EnvQueue *q)
+{
+	struct Env *e = q->eq_head;
+
+	if (e)
+		envq_remove(e);
+	return e;
+}
+
+// Put the runnable env 'e' on a run queue.  An env preempted on this
+// CPU stays local (its cache state is here); new and woken envs go to
+// the shortest queue, preferring this CPU on ties.
+void
+sched_enqueue(struct Env *e, bool local)
+{
+	struct CpuInfo *c, *best = thiscpu;
+
+	if (!local)
+		for (c = cpus; c < cpus + ncpu; c++)
+			if (c->cpu_runq.eq_len < best->cpu_runq.eq_len)
+				best = c;
+	envq_push(&best->cpu_runq, e);
+}
+
+// Put the blocked env 'e' on the blocked list.
+void
+sched_block(struct Env *e)
+{
+	envq_push(&blocked_envs, e);
+}
+
+// Take 'e' off whatever queue it is on.
+void
+sched_dequeue(struct Env *e)
+{
+	if (e->env_sched_queue)
+		envq_remove(e);
+}
+
+// Take an env from the longest run queue of another CPU.
+static struct Env *
+sched_steal(void)
+{
+	struct CpuInfo *c, *victim = NULL;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_runq.eq_len > 0 &&
+		    (!victim || c->cpu_runq.eq_len > victim->cpu_runq.eq_len))
+			victim = c;
+	return victim ? envq_pop(&victim->cpu_runq) : NULL;
+}
+
 // Choose a user environment to run and run it.
+// Must be called with env_lock held.
 void
 sched_yield(void)
 {
-	struct Env *idle;
+	struct Env *e;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment. Make sure curenv is not null before
-	// dereferencing it.
+	// Free a zombie that was destroyed while it was running here.
+	if (curenv != NULL && curenv->env_status == ENV_DYING) {
+		env_free(curenv);
+		curenv = NULL;
+	}
+
+	// Round-robin over this CPU's run queue: a preempted env is put
+	// back at the tail by env_run, so every runnable env gets its
+	// turn.  Blocked envs are never on a run queue, so this is
+	// constant time no matter how many envs exist.  If our queue is
+	// empty, steal work from the busiest other CPU.
 	//
 	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING). If there are
-	// no runnable environments, simply drop through to the code
-	// below to halt the cpu.
-
-	// LAB 4: Your code here.
-
-	// NOTE: 轮询调度, 不是每次都从第一个开始查找的, 这样会使得后面的进程饿死
-	int start = 0;
-	if(curenv != NULL)
-		start = ENVX(curenv->env_id) + 1;
-
-	for(int i = 0; i < NENV; ++i) {
-		start %= NENV;
-		if(envs[start].env_status == ENV_RUNNABLE)
-			env_run(&envs[start]);
-		start += 1;
-	}
+	// another CPU: running envs are not on any queue.
+	if ((e = envq_pop(&thiscpu->cpu_runq)) || (e = sched_steal()))
+		env_run(e);
 
 	// 没有找到可以调度的进程, 则恢复当前进程的运行
-	// TODO: 按道理halt中已经开启了时钟中断, 这里应该可以不用了啊
-	if(curenv != NULL && curenv->env_status == ENV_RUNNING)
+	if (curenv != NULL && curenv->env_status == ENV_RUNNING)
 		env_run(curenv);
 
-	// NOTE: 是不是应该有一个空闲进程???
 	// sched_halt never returns
 	sched_halt();
 }
@@ -63,13 +140,16 @@ sched_halt(void)
 
 	// For debugging and testing purposes, if there are no runnable
 	// environments in the system, then drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if ((envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING ||
-		     envs[i].env_status == ENV_DYING))
+	// Runnable envs sit on some run queue; running and dying envs are
+	// some CPU's cpu_env.
+	for (i = 0; i < ncpu; i++) {
+		if (cpus[i].cpu_runq.eq_len > 0 ||
+		    (cpus[i].cpu_env &&
+		     (cpus[i].cpu_env->env_status == ENV_RUNNING ||
+		      cpus[i].cpu_env->env_status == ENV_DYING)))
 			break;
 	}
-	if (i == NENV) {
+	if (i == ncpu) {
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -79,13 +159,11 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// Release env_lock as if we were "leaving" the kernel
+	spin_unlock(&env_lock);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
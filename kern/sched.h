@@ -6,7 +6,13 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_enqueue(struct Env *e, bool local);
+void sched_block(struct Env *e);
+void sched_dequeue(struct Env *e);
+
 #endif	// !JOS_KERN_SCHED_H
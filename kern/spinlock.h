@@ -25,24 +25,23 @@ void spin_unlock(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
-extern struct spinlock kernel_lock;
-
-static inline void
-lock_kernel(void)
-{
-	spin_lock(&kernel_lock);
-}
-
-static inline void
-unlock_kernel(void)
-{
-	spin_unlock(&kernel_lock);
-
-	// Normally we wouldn't need to do this, but QEMU only runs
-	// one CPU at a time and has a long time-slice.  Without the
-	// pause, this CPU is likely to reacquire the lock before
-	// another CPU has even been given a chance to acquire it.
-	asm volatile("pause");
-}
+// The kernel's locks.  A CPU that needs more than one must acquire them
+// in this order:
+//
+//	env_lock	envs[], the env free list, env status and the
+//			run queues (kern/env.c)
+//	ipc_lock	the env_ipc_* fields (kern/syscall.c)
+//	pmap_lock	user page tables and pp_ref (kern/pmap.c)
+//	pc_lock		a CPU's page cache (kern/cpu.h)
+//	page_lock	the physical page free list (kern/pmap.c)
+//
+// cons_lock (kern/console.c) is only ever taken last.
+
+// Statically initialize a spinlock named 'lock'.
+#ifdef DEBUG_SPINLOCK
+# define SPINLOCK_INITIALIZER(lock)	{ .name = #lock }
+#else
+# define SPINLOCK_INITIALIZER(lock)	{ 0 }
+#endif
 
 #endif
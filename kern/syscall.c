@@ -11,6 +11,27 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
+
+// Protects the env_ipc_* fields of all envs.  See kern/spinlock.h.
+static struct spinlock ipc_lock = SPINLOCK_INITIALIZER(ipc_lock);
+
+// Like envid2env, but also checks that the env still has an address
+// space.  Must be called with pmap_lock held; env_free tears address
+// spaces down under the same lock, so the result stays valid until the
+// caller releases it.
+static int
+envid2vm(envid_t envid, struct Env **env_store, bool checkperm)
+{
+	int r;
+
+	if ((r = envid2env(envid, env_store, checkperm)) < 0)
+		return r;
+	if ((*env_store)->env_pgdir == NULL)
+		return -E_BAD_ENV;
+	return 0;
+}
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -25,7 +46,16 @@ sys_cputs(const char *s, size_t len)
 	user_mem_assert(curenv, s, len, 0);
 
 	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// NOTE: 没有大内核锁, 其他CPU上共享地址空间的env可能随时解除映射,
+	// 所以分段拷贝到内核缓冲区后再打印
+	char buf[256];
+	size_t n;
+
+	for(; len > 0; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		user_mem_copyin(curenv, buf, s, n);
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console without blocking.
@@ -54,16 +84,18 @@ sys_env_destroy(envid_t envid)
 	int r;
 	struct Env *e;
 
-	if ((r = envid2env(envid, &e, 1)) < 0)
-		return r;
-	env_destroy(e);
-	return 0;
+	spin_lock(&env_lock);
+	if ((r = envid2env(envid, &e, 1)) == 0)
+		env_destroy(e);
+	spin_unlock(&env_lock);
+	return r;
 }
 
 // Deschedule current environment and pick a different one to run.
 static void
 sys_yield(void)
 {
+	spin_lock(&env_lock);
 	sched_yield();
 }
 
@@ -86,19 +118,74 @@ sys_exofork(void)
 	struct Env *e = NULL;
 	envid_t pid = curenv->env_id;
 	int res = 0;
-	if((res = env_alloc(&e, pid)) < 0)
+	spin_lock(&env_lock);
+	if((res = env_alloc(&e, pid)) < 0) {
+		spin_unlock(&env_lock);
 		return res;
+	}
 
 	assert(e != NULL);
 
-	e->env_status = ENV_NOT_RUNNABLE;
+	env_set_status(e, ENV_NOT_RUNNABLE);
 	e->env_tf = curenv->env_tf;
 	// 修改寄存器的值, 使得子进程得到的进程号是0
 	e->env_tf.tf_regs.reg_eax = 0;
+	spin_unlock(&env_lock);
 
 	return e->env_id;
 }
 
+// Fork curenv in one system call.  The child gets curenv's registers
+// and page fault upcall, a copy-on-write copy of its address space
+// below USTACKTOP, and a fresh user exception stack, and is made
+// runnable.  The page fault upcall must handle PTE_COW faults.
+//
+// Returns envid of new environment to the parent and 0 to the child,
+// < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork_cow(void)
+{
+	struct Env *e = NULL;
+	struct PageInfo *pp;
+	int r;
+
+	spin_lock(&env_lock);
+	if((r = env_alloc(&e, curenv->env_id)) < 0) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+	env_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	// NOTE: 子进程还不可运行, 也没有其他env知道它的envid, 复制地址空间时
+	// 不需要持有env_lock, 避免长时间阻塞其他CPU的调度
+	spin_unlock(&env_lock);
+
+	spin_lock(&pmap_lock);
+	r = pgdir_copy_cow(e->env_pgdir, curenv->env_pgdir, USTACKTOP);
+	if(r == 0 && (pp = page_alloc(ALLOC_ZERO)) == NULL)
+		r = -E_NO_MEM;
+	if(r == 0 && (r = page_insert(e->env_pgdir, pp, (void *)(UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		page_free(pp);
+	// NOTE: 父进程的可写页面刚被改成只读, 刷新TLB
+	lcr3(PADDR(curenv->env_pgdir));
+	spin_unlock(&pmap_lock);
+
+	spin_lock(&env_lock);
+	if(r < 0)
+		env_free(e);
+	else {
+		// 子进程一旦可运行就可能在其他CPU上退出, 先记下envid
+		r = e->env_id;
+		env_set_status(e, ENV_RUNNABLE);
+	}
+	spin_unlock(&env_lock);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -121,10 +208,17 @@ sys_env_set_status(envid_t envid, int status)
 		return -E_INVAL;
 
 	struct Env *e;
-	if(envid2env(envid, &e, 1) < 0)
+	spin_lock(&env_lock);
+	if(envid2env(envid, &e, 1) < 0) {
+		spin_unlock(&env_lock);
 		return -E_BAD_ENV;
+	}
 
-	e->env_status = status;
+	// NOTE: 正在运行的env不能被放入运行队列
+	if(status == ENV_NOT_RUNNABLE ||
+	   (e->env_status != ENV_RUNNING && e->env_status != ENV_DYING))
+		env_set_status(e, status);
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -143,15 +237,24 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	// address!
 	// panic("sys_env_set_trapframe not implemented");
 	struct Env *env = NULL;
-	if(envid2env(envid, &env, 1) < 0 || env == NULL)
+	struct Trapframe ktf;
+	// NOTE: tf在当前env的地址空间中, 先在pmap_lock下拷贝到内核栈上再检查.
+	// 段寄存器直接改成用户段, 只给cs加上RPL 3的话, GD_KT|3之类的值会让
+	// iret在内核中出错
+	user_mem_copyin(curenv, &ktf, tf, sizeof(struct Trapframe));
+	ktf.tf_cs = GD_UT | 3;
+	ktf.tf_ds = ktf.tf_es = ktf.tf_ss = GD_UD | 3;
+	ktf.tf_eflags &= ~(FL_IOPL_MASK | FL_NT | FL_VM);
+	ktf.tf_eflags |= FL_IF;
+
+	spin_lock(&env_lock);
+	if(envid2env(envid, &env, 1) < 0 || env == NULL) {
+		spin_unlock(&env_lock);
 		return -E_BAD_ENV;
+	}
 
-	user_mem_assert(env, tf, sizeof(struct Trapframe), PTE_U);
-
-	env->env_tf = (*tf);
-	env->env_tf.tf_cs |= 0x3;
-	env->env_tf.tf_eflags &= (~FL_IOPL_3);
-	env->env_tf.tf_eflags |= FL_IF;
+	env->env_tf = ktf;
+	spin_unlock(&env_lock);
 
 	return 0;
 }
@@ -171,13 +274,17 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	// panic("sys_env_set_pgfault_upcall not implemented");
 
 	struct Env *env = NULL;
-	if(envid2env(envid, &env, 1) < 0)
+	spin_lock(&env_lock);
+	if(envid2env(envid, &env, 1) < 0) {
+		spin_unlock(&env_lock);
 		return -E_BAD_ENV;
+	}
 
 	assert(env != NULL);
 	// TODO: 检查func指针是否合法
 
 	env->env_pgfault_upcall = func;
+	spin_unlock(&env_lock);
 	return 0;
 }
 
@@ -219,20 +326,24 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if((uint32_t)va >= UTOP || ((uint32_t)va & 0xfff) != 0)
 		return -E_INVAL;
 
-	// 获取env
-	struct Env *env = NULL;
-	if(envid2env(envid, &env, 1) < 0)
-		return -E_BAD_ENV;
-
-	// 分配页面并映射
+	// 分配页面, 清零操作不需要持有pmap_lock
 	struct PageInfo *pp = NULL;
 	if((pp = page_alloc(ALLOC_ZERO)) == NULL)
 		return -E_NO_MEM;
 
-	if(page_insert(env->env_pgdir, pp, va, perm) < 0)
-		return -E_NO_MEM;
-
-	return 0;
+	// 获取env并映射
+	struct Env *env = NULL;
+	int r = 0;
+	spin_lock(&pmap_lock);
+	if(envid2vm(envid, &env, 1) < 0)
+		r = -E_BAD_ENV;
+	else if(page_insert(env->env_pgdir, pp, va, perm) < 0)
+		r = -E_NO_MEM;
+	spin_unlock(&pmap_lock);
+
+	if(r < 0)
+		page_free(pp);
+	return r;
 }
 
 // Map the page of memory at 'srcva' in srcenvid's address space
@@ -272,28 +383,34 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	   || (uint32_t)dstva >= UTOP || ((uint32_t)dstva & 0xfff) != 0)
 		return -E_INVAL;
 
+	if((perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) ||
+	   ((perm & ~PTE_SYSCALL) != 0))
+		return -E_INVAL;
+
 	// 获取srcenv和dstenv
 	struct Env *srcenv = NULL, *dstenv = NULL;
-	if(envid2env(srcenvid, &srcenv, 0) < 0 || envid2env(dstenvid, &dstenv, 0) < 0)
-		return -E_BAD_ENV;
-
-	assert(srcenv != NULL && dstenv != NULL);
+	int r = 0;
+	spin_lock(&pmap_lock);
+	if(envid2vm(srcenvid, &srcenv, 0) < 0 || envid2vm(dstenvid, &dstenv, 0) < 0) {
+		r = -E_BAD_ENV;
+		goto out;
+	}
 
 	// 检查perm
 	pp = page_lookup(srcenv->env_pgdir, srcva, &pte);
-	if(pp == NULL || pte == NULL || (*pte & PTE_P) == 0)
-		return -E_INVAL;
-	if((perm & PTE_W) == PTE_W && (*pte & PTE_W) != PTE_W)
-		return -E_INVAL;
-	if((perm & (PTE_U | PTE_P))!= (PTE_U | PTE_P) ||
-	   ((perm & ~PTE_SYSCALL) != 0))
-		return -E_INVAL;
+	if(pp == NULL || pte == NULL || (*pte & PTE_P) == 0 ||
+	   ((perm & PTE_W) == PTE_W && (*pte & PTE_W) != PTE_W)) {
+		r = -E_INVAL;
+		goto out;
+	}
 
 	// 复制映射
 	if(page_insert(dstenv->env_pgdir, pp, dstva, perm) < 0)
-		return -E_NO_MEM;
+		r = -E_NO_MEM;
 
-	return 0;
+out:
+	spin_unlock(&pmap_lock);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -314,15 +431,330 @@ sys_page_unmap(envid_t envid, void *va)
 		return -E_INVAL;
 
 	struct Env *env = NULL;
-	if(envid2env(envid, &env, 1) < 0)
+	spin_lock(&pmap_lock);
+	if(envid2vm(envid, &env, 1) < 0) {
+		spin_unlock(&pmap_lock);
 		return -E_BAD_ENV;
-
-	assert(env != NULL);
+	}
 
 	page_remove(env->env_pgdir, va);
+	spin_unlock(&pmap_lock);
+	return 0;
+}
+
+// Apply one sys_page_batch operation.  Must be called with pmap_lock held.
+static int
+page_op(struct Env *srcenv, struct Env *dstenv, const struct PageOp *op)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if((uint32_t)op->dstva >= UTOP || ((uint32_t)op->dstva & 0xfff) != 0)
+		return -E_INVAL;
+	if(op->op != PAGEOP_UNMAP &&
+	   ((op->perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) || (op->perm & ~PTE_SYSCALL) != 0))
+		return -E_INVAL;
+
+	switch(op->op) {
+	case PAGEOP_ALLOC:
+		if((pp = page_alloc(ALLOC_ZERO)) == NULL)
+			return -E_NO_MEM;
+		if(page_insert(dstenv->env_pgdir, pp, op->dstva, op->perm) < 0) {
+			page_free(pp);
+			return -E_NO_MEM;
+		}
+		return 0;
+	case PAGEOP_MAP:
+		if((uint32_t)op->srcva >= UTOP || ((uint32_t)op->srcva & 0xfff) != 0)
+			return -E_INVAL;
+		pp = page_lookup(srcenv->env_pgdir, op->srcva, &pte);
+		if(pp == NULL || ((op->perm & PTE_W) == PTE_W && (*pte & PTE_W) != PTE_W))
+			return -E_INVAL;
+		if(page_insert(dstenv->env_pgdir, pp, op->dstva, op->perm) < 0)
+			return -E_NO_MEM;
+		return 0;
+	case PAGEOP_UNMAP:
+		page_remove(dstenv->env_pgdir, op->dstva);
+		return 0;
+	default:
+		return -E_INVAL;
+	}
+}
+
+// Apply the 'n' operations in 'ops' (see inc/syscall.h) in order, with
+// srcenvid and dstenvid standing in for the envids that sys_page_alloc,
+// sys_page_map and sys_page_unmap take.  Stops at the first operation
+// that fails and stores its error code in *errp, if errp is not NULL.
+//
+// The operations are copied in PAGE_BATCH_CHUNK at a time, and pmap_lock
+// is dropped between chunks so that a long batch does not hold up other
+// CPUs.  An operation may therefore unmap a later part of 'ops' itself;
+// that is caught when the chunk is copied.
+//
+// Returns the number of operations applied, or < 0 on error:
+//	-E_INVAL if n < 0 or too large.
+// Destroys the environment if 'ops' or 'errp' is not valid user memory.
+#define PAGE_BATCH_CHUNK	64
+
+static int
+sys_page_batch(envid_t srcenvid, envid_t dstenvid, const struct PageOp *ops,
+	       int n, int *errp)
+{
+	struct PageOp chunk[PAGE_BATCH_CHUNK];
+	struct Env *srcenv = NULL, *dstenv = NULL;
+	int done = 0, i, m, r = 0;
+
+	if(n < 0 || n > UTOP / sizeof(struct PageOp))
+		return -E_INVAL;
+	user_mem_assert(curenv, ops, n * sizeof(struct PageOp), PTE_U);
+	if(errp != NULL)
+		user_mem_assert(curenv, errp, sizeof(*errp), PTE_U | PTE_W);
+
+	while(done < n && r == 0) {
+		m = MIN(n - done, PAGE_BATCH_CHUNK);
+		user_mem_copyin(curenv, chunk, &ops[done], m * sizeof(struct PageOp));
+		spin_lock(&pmap_lock);
+		if(envid2vm(srcenvid, &srcenv, 1) < 0 || envid2vm(dstenvid, &dstenv, 1) < 0)
+			r = -E_BAD_ENV;
+		for(i = 0; r == 0 && i < m; i++, done++)
+			if((r = page_op(srcenv, dstenv, &chunk[i])) < 0)
+				break;
+		spin_unlock(&pmap_lock);
+	}
+
+	if(r < 0 && errp != NULL)
+		user_mem_copyout(curenv, errp, &r, sizeof(*errp));
+	return done;
+}
+
+// Copy a message from 'src' to 'dst', which must be blocked in a
+// receive, mapping the page at 'srcva' if both sides asked for one.
+// Must be called with ipc_lock held.
+static int
+ipc_transfer(struct Env *src, struct Env *dst, uint32_t value, void *srcva, unsigned perm)
+{
+	int r;
+
+	dst->env_ipc_perm = 0;
+	if((uint32_t)(dst->env_ipc_dstva) != UTOP && (uint32_t)(srcva) != UTOP) {
+		if((r = sys_page_map(src->env_id, srcva, dst->env_id, dst->env_ipc_dstva, perm)) < 0)
+			return r;
+		dst->env_ipc_perm = perm;
+	}
+
+	dst->env_ipc_recving = false;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_value = value;
 	return 0;
 }
 
+// Deliver a message from curenv to envid, which must be blocked in a
+// receive.  Stores the target in *target_store, also when failing with
+// -E_IPC_NOT_RECV.  The caller is responsible for waking the target.
+// Errors are as for sys_ipc_try_send.
+// Must be called with env_lock held.
+static int
+ipc_deliver(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+	    struct Env **target_store)
+{
+	// 检查srcva和perm是否合法
+	if((uintptr_t)srcva > UTOP)
+		return -E_INVAL;
+	else if((uintptr_t)srcva % PGSIZE != 0)
+		return -E_INVAL;
+	else if(perm & (~PTE_SYSCALL))
+		return -E_INVAL;
+
+	pte_t *pte = NULL;
+	bool mapped = true;
+	if((uint32_t)srcva != UTOP) {
+		spin_lock(&pmap_lock);
+		pte = pgdir_walk(curenv->env_pgdir, srcva, 0);
+		mapped = pte != NULL && ((*pte) & PTE_P);
+		spin_unlock(&pmap_lock);
+	}
+	if(!mapped)
+		return -E_INVAL;
+
+	// NOTE: 临时注释掉这个检查条件, TODO: 确认bug产生的原因
+	// else if((perm & PTE_W) == PTE_W && ((*pte) & PTE_W) != PTE_W)
+	//	return -E_INVAL;
+
+	// 检查target_env是否存在
+	struct Env *target_env = NULL;
+	if(envid2env(envid, &target_env, 0) < 0 || target_env == NULL)
+		return -E_BAD_ENV;
+	*target_store = target_env;
+
+	// 检查target_env是否正在等待接受消息
+	int r;
+	spin_lock(&ipc_lock);
+	if(!target_env->env_ipc_recving)
+		r = -E_IPC_NOT_RECV;
+	else
+		r = ipc_transfer(curenv, target_env, value, srcva, perm);
+	spin_unlock(&ipc_lock);
+	return r;
+}
+
+// Finish the system call 'e' is blocked in with return value 'r'.
+// Must be called with env_lock held.
+static void
+ipc_wake(struct Env *e, int r)
+{
+	// NOTE: 父进程可能已经通过sys_env_set_status把它设为可运行
+	if(e->env_status != ENV_NOT_RUNNABLE)
+		return;
+	e->env_tf.tf_regs.reg_eax = r;
+	env_set_status(e, ENV_RUNNABLE);
+}
+
+// Queue curenv at the tail of target's senders with its message and
+// block it.  The target delivers the message when it next receives (see
+// ipc_wait); with 'call' set, curenv then waits for a reply into
+// 'dstva' as sys_ipc_recv does.  The caller must give up the CPU.
+// Must be called with env_lock held.
+static void
+ipc_block_send(struct Env *target, uint32_t value, void *srcva, unsigned perm,
+	       bool call, void *dstva)
+{
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_call = call;
+	curenv->env_ipc_send_dstva = dstva;
+
+	spin_lock(&ipc_lock);
+	curenv->env_ipc_send_target = target;
+	curenv->env_ipc_send_next = NULL;
+	if(target->env_ipc_senders_tail)
+		target->env_ipc_senders_tail->env_ipc_send_next = curenv;
+	else
+		target->env_ipc_senders = curenv;
+	target->env_ipc_senders_tail = curenv;
+	spin_unlock(&ipc_lock);
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+}
+
+// Queue a reply from curenv on 'target', which is not receiving, for its
+// next receive to deliver (see ipc_take_reply).  The page at 'srcva', if
+// any, is held by reference until then, so the sender may go on to
+// unmap it.  Returns -E_IPC_NOT_RECV if target already has a reply
+// queued, or -E_INVAL for a page that sys_page_map would refuse.
+// Must be called with env_lock held.
+static int
+ipc_queue_reply(struct Env *target, uint32_t value, void *srcva, unsigned perm)
+{
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
+	int r = 0;
+
+	spin_lock(&ipc_lock);
+	if(target->env_ipc_reply) {
+		spin_unlock(&ipc_lock);
+		return -E_IPC_NOT_RECV;
+	}
+	if((uint32_t)srcva != UTOP) {
+		spin_lock(&pmap_lock);
+		pp = page_lookup(curenv->env_pgdir, srcva, &pte);
+		if(pp == NULL || (perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P) ||
+		   ((perm & PTE_W) == PTE_W && (*pte & PTE_W) != PTE_W))
+			r = -E_INVAL;
+		else
+			pp->pp_ref++;
+		spin_unlock(&pmap_lock);
+	}
+	if(r == 0) {
+		target->env_ipc_reply = true;
+		target->env_ipc_reply_from = curenv->env_id;
+		target->env_ipc_reply_value = value;
+		target->env_ipc_reply_page = pp;
+		target->env_ipc_reply_perm = pp ? perm : 0;
+	}
+	spin_unlock(&ipc_lock);
+	return r;
+}
+
+// Complete e's receive with the reply queued on it, if there is one.
+// A page that can't be mapped is dropped, as when e asks for none.
+// Must be called with env_lock and ipc_lock held.
+static bool
+ipc_take_reply(struct Env *e)
+{
+	struct PageInfo *pp = e->env_ipc_reply_page;
+
+	if(!e->env_ipc_reply)
+		return false;
+	e->env_ipc_perm = 0;
+	if(pp) {
+		spin_lock(&pmap_lock);
+		if((uint32_t)e->env_ipc_dstva != UTOP &&
+		   page_insert(e->env_pgdir, pp, e->env_ipc_dstva, e->env_ipc_reply_perm) == 0)
+			e->env_ipc_perm = e->env_ipc_reply_perm;
+		page_decref(pp);
+		spin_unlock(&pmap_lock);
+	}
+	e->env_ipc_reply = false;
+	e->env_ipc_reply_page = NULL;
+	e->env_ipc_recving = false;
+	e->env_ipc_from = e->env_ipc_reply_from;
+	e->env_ipc_value = e->env_ipc_reply_value;
+	return true;
+}
+
+// Take the first sender off e's queue.  Must be called with ipc_lock held.
+static struct Env *
+ipc_dequeue_sender(struct Env *e)
+{
+	struct Env *s;
+
+	if((s = e->env_ipc_senders) == NULL)
+		return NULL;
+	e->env_ipc_senders = s->env_ipc_send_next;
+	if(e->env_ipc_senders == NULL)
+		e->env_ipc_senders_tail = NULL;
+	s->env_ipc_send_next = NULL;
+	s->env_ipc_send_target = NULL;
+	return s;
+}
+
+// Fail every send blocked on 'e' with -E_BAD_ENV, drop the reply queued
+// on it, and take 'e' off the queue of the env it is blocked sending to.
+// Called by env_free.  Must be called with env_lock held.
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s, *prev, *target;
+
+	spin_lock(&ipc_lock);
+	e->env_ipc_recving = false;
+	while((s = ipc_dequeue_sender(e)) != NULL)
+		ipc_wake(s, -E_BAD_ENV);
+	if(e->env_ipc_reply && e->env_ipc_reply_page) {
+		spin_lock(&pmap_lock);
+		page_decref(e->env_ipc_reply_page);
+		spin_unlock(&pmap_lock);
+	}
+	e->env_ipc_reply = false;
+	e->env_ipc_reply_page = NULL;
+
+	if((target = e->env_ipc_send_target) != NULL) {
+		prev = NULL;
+		for(s = target->env_ipc_senders; s != e; s = s->env_ipc_send_next)
+			prev = s;
+		if(prev)
+			prev->env_ipc_send_next = e->env_ipc_send_next;
+		else
+			target->env_ipc_senders = e->env_ipc_send_next;
+		if(target->env_ipc_senders_tail == e)
+			target->env_ipc_senders_tail = prev;
+		e->env_ipc_send_next = NULL;
+		e->env_ipc_send_target = NULL;
+	}
+	spin_unlock(&ipc_lock);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -366,47 +798,125 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	// LAB 4: Your code here.
 	// panic("sys_ipc_try_send not implemented");
-	// 检查srcva和perm是否合法
-	if((uintptr_t)srcva > UTOP)
-		return -E_INVAL;
-	else if((uintptr_t)srcva % PGSIZE != 0)
-		return -E_INVAL;
-	else if(perm & (~PTE_SYSCALL))
-		return -E_INVAL;
+	struct Env *target_env = NULL;
+	int r;
 
-	pte_t *pte = NULL;
-	pte = pgdir_walk(curenv->env_pgdir, srcva, 0);
-	if(((uint32_t)srcva != UTOP) && (pte == NULL || !((*pte) & PTE_P)))
-		return -E_INVAL;
+	spin_lock(&env_lock);
+	if((r = ipc_deliver(envid, value, srcva, perm, &target_env)) == 0)
+		ipc_wake(target_env, 0);
+	spin_unlock(&env_lock);
+	return r;
+}
 
-	// NOTE: 临时注释掉这个检查条件, TODO: 确认bug产生的原因
-	// else if((perm & PTE_W) == PTE_W && ((*pte) & PTE_W) != PTE_W)
-	//	return -E_INVAL;
+// Like sys_ipc_try_send, but if envid is not receiving, block until it
+// is instead of failing with -E_IPC_NOT_RECV.  Senders blocked on the
+// same env are served in FIFO order.  Returns < 0 on error, including
+// -E_BAD_ENV if envid exits before receiving the message.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	struct Env *target_env = NULL;
+	int r;
 
-	// 检查target_env是否存在
+	spin_lock(&env_lock);
+	r = ipc_deliver(envid, value, srcva, perm, &target_env);
+	if(r == -E_IPC_NOT_RECV) {
+		ipc_block_send(target_env, value, srcva, perm, false, NULL);
+		sched_yield();
+	}
+	if(r == 0)
+		ipc_wake(target_env, 0);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Send a reply to a request from 'envid' as sys_ipc_try_send would.  If
+// envid is not receiving, because it sent with plain sys_ipc_send and
+// has not reached sys_ipc_recv yet, the reply is queued for its next
+// receive instead of failing.  This never blocks, so a client that is
+// slow to receive does not hold up the server.
+//
+// Returns 0 on success, < 0 on error.  Errors are as for
+// sys_ipc_try_send, except that -E_IPC_NOT_RECV means envid is not
+// receiving and already has a reply queued.
+static int
+sys_ipc_reply(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
 	struct Env *target_env = NULL;
-	if(envid2env(envid, &target_env, 0) < 0 || target_env == NULL)
-		return -E_BAD_ENV;
+	int r;
 
-	// 检查target_env是否正在等待接受消息
-	if(!target_env->env_ipc_recving || target_env->env_status != ENV_NOT_RUNNABLE)
-		return -E_IPC_NOT_RECV;
+	spin_lock(&env_lock);
+	r = ipc_deliver(envid, value, srcva, perm, &target_env);
+	if(r == -E_IPC_NOT_RECV)
+		r = ipc_queue_reply(target_env, value, srcva, perm);
+	else if(r == 0)
+		ipc_wake(target_env, 0);
+	spin_unlock(&env_lock);
+	return r;
+}
 
+static bool irq_deliver_pending(struct Env *e);
 
-	target_env->env_ipc_recving = false;
-	target_env->env_ipc_from = curenv->env_id;
-	target_env->env_ipc_value = value;
-	target_env->env_ipc_perm = 0;
+// Start a receive into 'dstva' for 'e', which must be blocked or be
+// curenv.  If a queued reply, a pending IRQ or a queued sender can
+// complete it at once, it is delivered and this returns true.  A sender
+// whose message went through stays blocked if it is in sys_ipc_call, and
+// starts its own receive in turn; it is woken if that completes too.
+// Must be called with env_lock and ipc_lock held.
+static bool
+ipc_recv_start(struct Env *e, void *dstva)
+{
+	struct Env *first = e, *s, *next;
+	bool got, first_got = false;
+	int r;
 
-	if((uint32_t)(target_env->env_ipc_dstva) != UTOP && (uint32_t)(srcva) != UTOP) {
-		if(sys_page_map(curenv->env_id, srcva, envid, target_env->env_ipc_dstva, perm) < 0)
-			return -E_NO_MEM;
-		target_env->env_ipc_perm = perm;
+	// NOTE: 用循环而不是递归处理一串互相调用的env, 避免内核栈溢出
+	while(e) {
+		e->env_ipc_recving = true;
+		e->env_ipc_dstva = dstva;
+		got = ipc_take_reply(e) || irq_deliver_pending(e);
+		next = NULL;
+		// NOTE: 按FIFO顺序取出阻塞的发送方, 投递失败的发送方以错误码唤醒
+		while(!got && (s = ipc_dequeue_sender(e)) != NULL) {
+			r = ipc_transfer(s, e, s->env_ipc_send_value,
+					 s->env_ipc_send_srcva, s->env_ipc_send_perm);
+			if(r == 0 && s->env_ipc_send_call) {
+				s->env_tf.tf_regs.reg_eax = 0;
+				next = s;
+			} else
+				ipc_wake(s, r);
+			got = r == 0;
+		}
+		if(e == first)
+			first_got = got;
+		else if(got)
+			ipc_wake(e, 0);
+		if((e = next) != NULL)
+			dstva = next->env_ipc_send_dstva;
 	}
+	return first_got;
+}
 
-	target_env->env_status = ENV_RUNNABLE;
-	return 0;
+// Start a receive into 'dstva' for curenv.  If it completes at once (see
+// ipc_recv_start) this returns true and curenv keeps running.  Otherwise
+// curenv is blocked until a sender arrives and this returns false, in
+// which case the caller must give up the CPU.  Either way the receive
+// returns 0.  Must be called with env_lock held.
+static bool
+ipc_wait(void *dstva)
+{
+	bool got;
+
+	// 这里应该设置cuenv的eax, 使得用户进程接受到的系统调用返回值为0
+	curenv->env_tf.tf_regs.reg_eax = 0;
 
+	spin_lock(&ipc_lock);
+	got = ipc_recv_start(curenv, dstva);
+	spin_unlock(&ipc_lock);
+
+	if(!got)
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+	return got;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -428,17 +938,379 @@ sys_ipc_recv(void *dstva)
 	if((uintptr_t)dstva > UTOP || (uintptr_t)dstva  % PGSIZE != 0)
 		return -E_INVAL;
 
-	curenv->env_ipc_recving = true;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	spin_lock(&env_lock);
+	if(!ipc_wait(dstva))
+		sched_yield();
+	spin_unlock(&env_lock);
 
-	// 这里应该设置cuenv的eax, 使得用户进程接受到的系统调用返回值为0
+	return 0;
+}
+
+// Send to 'envid' as sys_ipc_send does, then block in a receive into
+// 'dstva' as sys_ipc_recv does, all in one system call.  If the target
+// was blocked waiting for us, this CPU switches straight to it without
+// going through the run queues.
+//
+// If the target is not receiving, sys_ipc_call queues the caller on it
+// as sys_ipc_send would, and starts its receive once the message has
+// gone through.  sys_ipc_reply_recv (the server side of a call) instead
+// queues the reply as sys_ipc_reply does and receives at once: this
+// matters when the client sent with plain ipc_send and has not reached
+// ipc_recv yet, and must not hold up the server's other clients.  A
+// reply to an env that no longer exists is dropped and the receive goes
+// ahead, since the client may just have exited.  Other failed sends are
+// returned without waiting.
+//
+// Returns < 0 on error, including -E_BAD_ENV if the target exits while
+// the call is queued on it; otherwise the receive eventually returns 0.
+static int
+sys_ipc_send_recv(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		  void *dstva, bool reply)
+{
+	struct Env *target_env = NULL;
+	bool queued = false;
+	int r;
+
+	if((uintptr_t)dstva > UTOP || (uintptr_t)dstva % PGSIZE != 0)
+		return -E_INVAL;
+
+	// NOTE: 发送前就持有env_lock, 保证对方在本env进入接收状态之前不会运行,
+	// 因此不会错过对方的回复
+	spin_lock(&env_lock);
+	r = ipc_deliver(envid, value, srcva, perm, &target_env);
+	if(r == -E_IPC_NOT_RECV && reply) {
+		r = ipc_queue_reply(target_env, value, srcva, perm);
+		queued = r == 0;
+	} else if(r == -E_IPC_NOT_RECV) {
+		ipc_block_send(target_env, value, srcva, perm, true, dstva);
+		sched_yield();
+	}
+	if(r < 0 && !(reply && r == -E_BAD_ENV)) {
+		spin_unlock(&env_lock);
+		return r;
+	}
+
+	if(!ipc_wait(dstva)) {
+		// 直接切换到接收方, 不经过调度器
+		if(r == 0 && !queued && target_env->env_status == ENV_NOT_RUNNABLE)
+			env_run(target_env);
+		sched_yield();
+	}
+
+	// A queued sender completed our receive at once; keep running.
+	if(r == 0 && !queued)
+		ipc_wake(target_env, 0);
+	spin_unlock(&env_lock);
+	return 0;
+}
+
+// Envs blocked in sys_futex_wait, hashed by the physical address of
+// the word they wait on, so envs that map a shared page at different
+// addresses still meet, and how many there are.  Protected by env_lock.
+// Pages that hold a word waited on are marked PP_FUTEX.
+#define FUTEX_HASH	64
+static struct Env *futex_waiters[FUTEX_HASH];
+static int futex_nwaiters;
+
+static struct Env **
+futex_chain(physaddr_t key)
+{
+	return &futex_waiters[(key >> 2) % FUTEX_HASH];
+}
+
+// Take e off the chain it waits on.  Must be called with env_lock held.
+static void
+futex_unlink(struct Env *e)
+{
+	struct Env **pe;
+
+	for(pe = futex_chain(e->env_futex_key); *pe != e; pe = &(*pe)->env_futex_next)
+		;
+	*pe = e->env_futex_next;
+	e->env_futex_next = NULL;
+	e->env_futex_key = 0;
+	futex_nwaiters--;
+}
+
+// Translate the user word at 'va' in curenv to the key its waiters are
+// hashed by, and return its kernel address in *kva_store.
+// Must be called with pmap_lock held.
+static int
+futex_key(uint32_t *va, physaddr_t *key_store, uint32_t **kva_store)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if((uintptr_t)va >= UTOP || (uintptr_t)va % sizeof(uint32_t) != 0)
+		return -E_INVAL;
+	if((pp = page_lookup(curenv->env_pgdir, va, &pte)) == NULL || !(*pte & PTE_U))
+		return -E_FAULT;
+	*key_store = page2pa(pp) + PGOFF(va);
+	if(kva_store)
+		*kva_store = (uint32_t *)(page2kva(pp) + PGOFF(va));
+	return 0;
+}
+
+// Block until another env calls sys_futex_wake on the same word, unless
+// the word at 'va' no longer holds 'val'.  Wakers change the word before
+// they take env_lock, so checking it under env_lock cannot miss a wakeup.
+// Callers must recheck their condition: wakeups may be spurious.
+//
+// Returns 0, or < 0 on error:
+//	-E_INVAL if va >= UTOP or va is not 4-byte aligned.
+//	-E_FAULT if va is not mapped in curenv.
+static int
+sys_futex_wait(uint32_t *va, uint32_t val)
+{
+	physaddr_t key;
+	uint32_t *kva;
+	struct Env **chain;
+	int r;
+
+	spin_lock(&env_lock);
+	spin_lock(&pmap_lock);
+	r = futex_key(va, &key, &kva);
+	if(r == 0 && *kva == val) {
+		// NOTE: 父进程可能用sys_env_set_status唤醒过我们, 先从旧链上摘下
+		if(curenv->env_futex_key)
+			futex_unlink(curenv);
+		chain = futex_chain(key);
+		curenv->env_futex_key = key;
+		curenv->env_futex_next = *chain;
+		*chain = curenv;
+		futex_nwaiters++;
+		pa2page(key)->pp_flags |= PP_FUTEX;
+		curenv->env_tf.tf_regs.reg_eax = 0;
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+		spin_unlock(&pmap_lock);
+		sched_yield();
+	}
+	spin_unlock(&pmap_lock);
+	spin_unlock(&env_lock);
+	return r;
+}
+
+// Wake every env blocked in sys_futex_wait on the word at 'va'.
+// Returns the number of envs woken, or < 0 on error as for
+// sys_futex_wait.
+static int
+sys_futex_wake(uint32_t *va)
+{
+	physaddr_t key;
+	struct Env *e, *next;
+	int r, n = 0;
+
+	spin_lock(&env_lock);
+	spin_lock(&pmap_lock);
+	r = futex_key(va, &key, NULL);
+	spin_unlock(&pmap_lock);
+	if(r == 0) {
+		for(e = *futex_chain(key); e; e = next) {
+			next = e->env_futex_next;
+			if(e->env_futex_key != key)
+				continue;
+			futex_unlink(e);
+			ipc_wake(e, 0);
+			n++;
+		}
+	}
+	spin_unlock(&env_lock);
+	return r < 0 ? r : n;
+}
+
+// Wake every env waiting on a word in the page at physical address pa.
+// Returns the number woken.  Must be called with env_lock held.
+static int
+futex_wake_page(physaddr_t pa)
+{
+	struct Env *e, *next;
+	int i, n = 0;
+
+	for(i = 0; i < FUTEX_HASH; i++)
+		for(e = futex_waiters[i]; e; e = next) {
+			next = e->env_futex_next;
+			if(ROUNDDOWN(e->env_futex_key, PGSIZE) != pa)
+				continue;
+			futex_unlink(e);
+			ipc_wake(e, 0);
+			n++;
+		}
+	return n;
+}
+
+// Take e off any futex chain, and wake the futex waiters on pages e has
+// mapped: e may have been the other end of a pipe they wait on, which
+// they only notice when they run again and find its pages gone.
+// Called by env_free before it unmaps e's pages.
+// Must be called with env_lock held.
+void
+futex_env_free(struct Env *e)
+{
+	struct PageInfo *pp;
+	pte_t *pt;
+	uint32_t pdeno, pteno;
+
+	if(e->env_futex_key)
+		futex_unlink(e);
+	if(futex_nwaiters == 0 || e->env_pgdir == NULL)
+		return;
+
+	spin_lock(&pmap_lock);
+	for(pdeno = 0; pdeno < PDX(UTOP) && futex_nwaiters > 0; pdeno++) {
+		if(!(e->env_pgdir[pdeno] & PTE_P))
+			continue;
+		pt = (pte_t *)KADDR(PTE_ADDR(e->env_pgdir[pdeno]));
+		for(pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if(!(pt[pteno] & PTE_P))
+				continue;
+			pp = pa2page(PTE_ADDR(pt[pteno]));
+			// NOTE: 没有等待者的页面清除标记, 下次sys_futex_wait会重新设置
+			if((pp->pp_flags & PP_FUTEX) && futex_wake_page(page2pa(pp)) == 0)
+				pp->pp_flags &= ~PP_FUTEX;
+		}
+	}
+	spin_unlock(&pmap_lock);
+}
+
+// The env blocked in sys_irq_wait on each IRQ, the env each IRQ is
+// delivered to as a message (see sys_irq_bind), and the IRQs that fired
+// while nobody waited.  Protected by env_lock.
+static struct Env *irq_waiter[MAX_IRQS];
+static struct Env *irq_recver[MAX_IRQS];
+static bool irq_pending[MAX_IRQS];
+
+// Block until IRQ 'irq' fires, unmasking it on first use.  Returns at
+// once if it fired since the last call.  Only the file server may wait,
+// since it alone drives devices.  As for futexes, callers must check the
+// device: wakeups may be spurious.
+//
+// Returns 0, or < 0 on error:
+//	-E_INVAL if irq is not a valid IRQ.
+//	-E_BAD_ENV if curenv is not the file server, or another env already
+//		waits on irq.
+static int
+sys_irq_wait(int irq)
+{
+	if(irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE)
+		return -E_INVAL;
+	if(curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+
+	spin_lock(&env_lock);
+	if(irq_waiter[irq] && irq_waiter[irq] != curenv) {
+		spin_unlock(&env_lock);
+		return -E_BAD_ENV;
+	}
+	if(irq_mask_8259A & (1 << irq))
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	if(irq_pending[irq]) {
+		irq_pending[irq] = false;
+		spin_unlock(&env_lock);
+		return 0;
+	}
+	irq_waiter[irq] = curenv;
 	curenv->env_tf.tf_regs.reg_eax = 0;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
 	sched_yield();
+}
 
+// Have IRQ 'irq' also end any receive curenv blocks in, as a message
+// from envid 0 whose value is irq.  This lets the file server wait for
+// the next request and for the disk at once.  An IRQ that fires while
+// curenv is not receiving is delivered by its next receive, unless
+// sys_irq_wait takes it first.
+//
+// Returns 0, or < 0 on error, as for sys_irq_wait.
+static int
+sys_irq_bind(int irq)
+{
+	if(irq < 0 || irq >= MAX_IRQS || irq == IRQ_SLAVE)
+		return -E_INVAL;
+	if(curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+
+	spin_lock(&env_lock);
+	if(irq_recver[irq] && irq_recver[irq] != curenv) {
+		spin_unlock(&env_lock);
+		return -E_BAD_ENV;
+	}
+	irq_recver[irq] = curenv;
+	if(irq_mask_8259A & (1 << irq))
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	spin_unlock(&env_lock);
 	return 0;
 }
 
+// Complete e's receive with the message for IRQ 'irq'.
+// Must be called with env_lock and ipc_lock held.
+static void
+irq_deliver(struct Env *e, int irq)
+{
+	e->env_ipc_recving = false;
+	e->env_ipc_from = 0;
+	e->env_ipc_value = irq;
+	e->env_ipc_perm = 0;
+}
+
+// Deliver a pending IRQ bound to e, which is starting a receive.
+// Returns true if there was one.
+// Must be called with env_lock and ipc_lock held.
+static bool
+irq_deliver_pending(struct Env *e)
+{
+	int i;
+
+	if(e->env_type != ENV_TYPE_FS)
+		return false;
+	for(i = 0; i < MAX_IRQS; i++)
+		if(irq_recver[i] == e && irq_pending[i]) {
+			irq_pending[i] = false;
+			irq_deliver(e, i);
+			return true;
+		}
+	return false;
+}
+
+// Deliver IRQ 'irq' to the env waiting on it, either in sys_irq_wait or
+// in a receive if the IRQ is bound to it, or remember it for the next
+// wait.  Called by trap_dispatch.
+void
+irq_notify(int irq)
+{
+	struct Env *e;
+
+	spin_lock(&env_lock);
+	if((e = irq_waiter[irq]) != NULL && e->env_status == ENV_NOT_RUNNABLE) {
+		irq_waiter[irq] = NULL;
+		ipc_wake(e, 0);
+	} else {
+		spin_lock(&ipc_lock);
+		if((e = irq_recver[irq]) != NULL && e->env_status == ENV_NOT_RUNNABLE
+		   && e->env_ipc_recving) {
+			irq_deliver(e, irq);
+			ipc_wake(e, 0);
+		} else
+			irq_pending[irq] = true;
+		spin_unlock(&ipc_lock);
+	}
+	spin_unlock(&env_lock);
+}
+
+// Stop e from waiting on or being bound to any IRQ.  Called by
+// env_free.  Must be called with env_lock held.
+void
+irq_env_free(struct Env *e)
+{
+	int i;
+
+	for(i = 0; i < MAX_IRQS; i++) {
+		if(irq_waiter[i] == e)
+			irq_waiter[i] = NULL;
+		if(irq_recver[i] == e)
+			irq_recver[i] = NULL;
+	}
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -478,6 +1350,12 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_exofork:
 		res = sys_exofork();
 		break;
+	case SYS_fork_cow:
+		res = sys_fork_cow();
+		break;
+	case SYS_page_batch:
+		res = sys_page_batch(a1, a2, (const struct PageOp *)a3, a4, (int *)a5);
+		break;
 	case SYS_env_set_status:
 		res = sys_env_set_status(a1, a2);
 		break;
@@ -490,12 +1368,37 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_yield:
 		sys_yield();
 		res = 0;
+		break;
 	case SYS_ipc_try_send:
 		res = sys_ipc_try_send(a1, a2, (void *)a3, a4);
 		break;
+	case SYS_ipc_send:
+		res = sys_ipc_send(a1, a2, (void *)a3, a4);
+		break;
 	case SYS_ipc_recv:
 		res = sys_ipc_recv((void *)a1);
 		break;
+	case SYS_ipc_call:
+		res = sys_ipc_send_recv(a1, a2, (void *)a3, a4, (void *)a5, false);
+		break;
+	case SYS_ipc_reply_recv:
+		res = sys_ipc_send_recv(a1, a2, (void *)a3, a4, (void *)a5, true);
+		break;
+	case SYS_ipc_reply:
+		res = sys_ipc_reply(a1, a2, (void *)a3, a4);
+		break;
+	case SYS_futex_wait:
+		res = sys_futex_wait((uint32_t *)a1, a2);
+		break;
+	case SYS_futex_wake:
+		res = sys_futex_wake((uint32_t *)a1);
+		break;
+	case SYS_irq_wait:
+		res = sys_irq_wait(a1);
+		break;
+	case SYS_irq_bind:
+		res = sys_irq_bind(a1);
+		break;
 	default:
 		break;
 	}
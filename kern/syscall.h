@@ -6,6 +6,12 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void	ipc_env_free(struct Env *e);
+void	futex_env_free(struct Env *e);
+void	irq_notify(int irq);
+void	irq_env_free(struct Env *e);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -71,6 +71,7 @@ void mchk_handler(void);
 void simderr_handler(void);
 
 void syscall_handler(void);
+void sysenter_handler(void);
 
 void default_handler(void);
 
@@ -80,6 +81,8 @@ void irq_kbd_handler(void);
 
 void irq_serial_handler(void);
 
+void irq_ide_handler(void);
+
 static const char *trapname(int trapno)
 {
 	static const char * const excnames[] = {
@@ -148,6 +151,7 @@ trap_init(void)
 	SETGATE(idt[IRQ_TIMER + IRQ_OFFSET], 0, GD_KT, irq_timer_handler, 0);
 	SETGATE(idt[IRQ_KBD + IRQ_OFFSET], 0, GD_KT, irq_kbd_handler, 0);
 	SETGATE(idt[IRQ_SERIAL + IRQ_OFFSET], 0, GD_KT, irq_serial_handler, 0);
+	SETGATE(idt[IRQ_IDE + IRQ_OFFSET], 0, GD_KT, irq_ide_handler, 0);
 	// Per-CPU setup
 	trap_init_percpu();
 }
@@ -201,6 +205,16 @@ trap_init_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Fast system calls: sysenter lands in sysenter_handler on this
+	// CPU's kernel stack, the same one the TSS names for int $T_SYSCALL.
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_FEAT_SEP) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, thiscpu->cpu_ts.ts_esp0);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -265,6 +279,14 @@ trap_dispatch(struct Trapframe *tf)
 	case T_BRKPT:
 		monitor(tf);
 		return;
+	case T_DEBUG:
+		// NOTE: 用户设置TF后执行sysenter, 单步异常会发生在内核态的
+		// sysenter_handler第一条指令处. 清除TF后直接回到那里继续执行
+		if ((tf->tf_cs & 3) == 0 && tf->tf_eip == (uintptr_t) sysenter_handler) {
+			tf->tf_eflags &= ~FL_TF;
+			env_pop_tf(tf);
+		}
+		break;
 	case T_SYSCALL:
 		tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx,
 			tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi, tf->tf_regs.reg_esi);
@@ -288,6 +310,7 @@ trap_dispatch(struct Trapframe *tf)
 	// 响应时钟中断, 执行调度算法
 	if(tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
+		spin_lock(&env_lock);
 		sched_yield();
 		return;
 	}
@@ -297,12 +320,19 @@ trap_dispatch(struct Trapframe *tf)
 
 	if(tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
 		kbd_intr();
-		env_run(curenv);
+		return;
 	}
 
 	if(tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
 		serial_intr();
-		env_run(curenv);
+		return;
+	}
+
+	// NOTE: 磁盘中断交给文件系统进程处理, 内核只负责唤醒它
+	if(tf->tf_trapno == IRQ_OFFSET + IRQ_IDE) {
+		irq_eoi_8259A(IRQ_IDE);
+		irq_notify(IRQ_IDE);
+		return;
 	}
 
 	// Unexpected trap: The user process or the kernel has a bug.
@@ -310,6 +340,7 @@ trap_dispatch(struct Trapframe *tf)
 	if (tf->tf_cs == GD_KT)
 		panic("unhandled trap in kernel");
 	else {
+		spin_lock(&env_lock);
 		env_destroy(curenv);
 		return;
 	}
@@ -327,10 +358,9 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
-	// Re-acqurie the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
-		lock_kernel();
+	// We may have been halted in sched_yield()
+	xchg(&thiscpu->cpu_status, CPU_STARTED);
+
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
 	// the interrupt path.
@@ -338,16 +368,14 @@ trap(struct Trapframe *tf)
 
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
-		// Acquire the big kernel lock before doing any
-		// serious kernel work.
-		// LAB 4: Your code here.
-		lock_kernel();
+		// There is no big kernel lock: each subsystem takes its own
+		// lock (see kern/spinlock.h), so syscalls that don't share
+		// state run in parallel on different CPUs.
 		assert(curenv);
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
+			spin_lock(&env_lock);
 			sched_yield();
 		}
 
@@ -370,11 +398,44 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
+	// if doing so makes sense.  A running env is on no run queue, so
+	// going back to it needs no lock.
 	if (curenv && curenv->env_status == ENV_RUNNING)
-		env_run(curenv);
-	else
+		env_pop_tf(&curenv->env_tf);
+	spin_lock(&env_lock);
+	sched_yield();
+}
+
+// Called from sysenter_handler with a Trapframe laid out exactly as
+// int $T_SYSCALL would have left it, so a dying env or a system call
+// that blocks or switches envs takes the ordinary paths.  Only the
+// common return to the caller is cheaper: sysexit instead of iret.
+void
+sysenter_trap(struct Trapframe *tf)
+{
+	asm volatile("cld" ::: "cc");
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	assert(curenv);
+	if (curenv->env_status == ENV_DYING) {
+		spin_lock(&env_lock);
 		sched_yield();
+	}
+
+	curenv->env_tf = *tf;
+	tf = &curenv->env_tf;
+	last_tf = tf;
+
+	tf->tf_regs.reg_eax = syscall(tf->tf_regs.reg_eax, tf->tf_regs.reg_edx, tf->tf_regs.reg_ecx,
+		tf->tf_regs.reg_ebx, tf->tf_regs.reg_edi, 0);
+
+	if (curenv->env_status == ENV_RUNNING)
+		env_sysexit(&curenv->env_tf);
+	spin_lock(&env_lock);
+	sched_yield();
 }
 
 
@@ -433,7 +494,7 @@ page_fault_handler(struct Trapframe *tf)
 		user_mem_assert(curenv, curenv->env_pgfault_upcall, 1, PTE_P|PTE_U);
 
 		// 计算user exception stack, 即指针utf
-		struct UTrapframe *utf;
+		struct UTrapframe *utf, u;
 
 		// TODO: 为什么在嵌套的情况下需要留一个大于4字节的间隙???
 		// NOTE: 因为在嵌套的情况下, 使用的都是user exception stack, 这个间隙是用来保存ret的返回地址的,
@@ -443,28 +504,28 @@ page_fault_handler(struct Trapframe *tf)
 		else
 			utf = (struct UTrapframe *)(UXSTACKTOP - sizeof(struct UTrapframe));
 
-		// 检查utf指针
-		user_mem_assert(curenv, utf, sizeof(struct UTrapframe), PTE_P|PTE_U|PTE_W);
-
-		// 在user exception stack上填充UTrapframe
-		utf->utf_fault_va = fault_va;
-		utf->utf_err = tf->tf_err;
-		utf->utf_regs = tf->tf_regs;
-		utf->utf_eip = tf->tf_eip;
-		utf->utf_eflags = tf->tf_eflags;
-		utf->utf_esp = tf->tf_esp;
+		// 先在内核栈上填充UTrapframe, 再由user_mem_copyout在pmap_lock下检查并
+		// 写到user exception stack上, 写不进去时curenv被销毁, 不会返回
+		u.utf_fault_va = fault_va;
+		u.utf_err = tf->tf_err;
+		u.utf_regs = tf->tf_regs;
+		u.utf_eip = tf->tf_eip;
+		u.utf_eflags = tf->tf_eflags;
+		u.utf_esp = tf->tf_esp;
+		user_mem_copyout(curenv, utf, &u, sizeof(struct UTrapframe));
 
 		// 调整tf, 使得控制能够转移到env_pgfault_upcall
 		tf->tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
 		tf->tf_esp = (uintptr_t)(utf);
 
 		// 转到pgfault_upcall执行
-		env_run(curenv);
+		env_pop_tf(tf);
 	}
 
 	// Destroy the environment that caused the fault.
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	spin_lock(&env_lock);
 	env_destroy(curenv);
 }
@@ -17,6 +17,7 @@ void trap_init(void);
 void trap_init_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
+void sysenter_trap(struct Trapframe *tf) __attribute__((noreturn));
 void page_fault_handler(struct Trapframe *);
 void backtrace(struct Trapframe *);
 
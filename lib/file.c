@@ -1,11 +1,43 @@
 #include <inc/fs.h>
 #include <inc/string.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Memory-mapped files live in [MMAPBASE, MMAPTOP).
+#define MMAPBASE	0xB0000000
+#define MMAPTOP		0xC0000000
+#define MAXMMAP		32
+
+struct Mmap {
+	char *m_addr;		// 0 if this slot is free
+	size_t m_len;		// bytes, a multiple of PGSIZE
+	int m_fileid;
+	off_t m_offset;		// file offset of m_addr
+	int m_prot;
+};
+
+static struct Mmap mmaps[MAXMMAP];
+
+// Like fsipc, but with the request body in the page at 'req' rather
+// than in fsipcbuf.
+static int
+fsipc_page(unsigned type, void *req, void *dstva)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
+
+	return ipc_call(fsenv, type, req, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
 // Send an inter-environment request to the file server, and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
@@ -15,20 +47,13 @@ union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 static int
 fsipc(unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
-	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
-
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return fsipc_page(type, &fsipcbuf, dstva);
 }
 
 static int devfile_flush(struct Fd *fd);
+static int devfile_close(struct Fd *fd);
 static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
@@ -39,7 +64,7 @@ struct Dev devfile =
 	.dev_id =	'f',
 	.dev_name =	"file",
 	.dev_read =	devfile_read,
-	.dev_close =	devfile_flush,
+	.dev_close =	devfile_close,
 	.dev_stat =	devfile_stat,
 	.dev_write =	devfile_write,
 	.dev_trunc =	devfile_trunc
@@ -103,6 +128,100 @@ devfile_flush(struct Fd *fd)
 	return fsipc(FSREQ_FLUSH, NULL);
 }
 
+static int
+devfile_close(struct Fd *fd)
+{
+	char *buf = fd2data(fd);
+	int i;
+
+	for (i = 0; i < FSBUF_PAGES; i++)
+		sys_page_unmap(0, buf + i*PGSIZE);
+	return devfile_flush(fd);
+}
+
+// Take the fd's shared buffer for this env.  fork and spawn share the
+// buffer pages along with the fd, so every env holding the fd may use
+// them; they take turns.  An env that died holding the buffer is
+// noticed and skipped.
+static void
+devfile_buf_lock(struct Fd *fd)
+{
+	struct FdFile *f = &fd->fd_file;
+	const volatile struct Env *e;
+	envid_t owner;
+
+	while ((owner = cmpxchg(&f->buf_owner, 0, thisenv->env_id)) != 0) {
+		e = &envs[ENVX(owner)];
+		if (e->env_id != owner || e->env_status == ENV_FREE) {
+			cmpxchg(&f->buf_owner, owner, 0);
+			continue;
+		}
+		// Setting buf_waiting with xchg orders it before the
+		// kernel's read of buf_owner; see devfile_buf_unlock.
+		xchg(&f->buf_waiting, 1);
+		sys_futex_wait(&f->buf_owner, owner);
+	}
+}
+
+static void
+devfile_buf_unlock(struct Fd *fd)
+{
+	struct FdFile *f = &fd->fd_file;
+
+	xchg(&f->buf_owner, 0);
+	if (f->buf_waiting) {
+		f->buf_waiting = 0;
+		sys_futex_wake(&f->buf_owner);
+	}
+}
+
+// Make sure the file server's buffer for this file is the one in the
+// fd's data area, setting it up if needed: the server keeps a single
+// buffer per open file, and an env that got the fd before it had a
+// buffer sets up pages of its own.  Must be called with the buffer
+// locked.  Returns 0 on success, < 0 on error.
+static int
+devfile_setbuf(struct Fd *fd)
+{
+	struct Fsreq_setbuf *req;
+	char *buf = fd2data(fd);
+	int i, r;
+
+	static_assert(FSBUF_SIZE <= FDDATASIZE);
+
+	// The pages are set up in order, so the last one marks the rest.
+	req = (struct Fsreq_setbuf *) (buf + (FSBUF_PAGES - 1)*PGSIZE);
+	if ((uvpd[PDX(req)] & PTE_P) && (uvpt[PGNUM(req)] & PTE_P)
+	    && PTE_ADDR(uvpt[PGNUM(req)]) == fd->fd_file.buf_pa)
+		return 0;
+	for (i = 0; i < FSBUF_PAGES; i++) {
+		req = (struct Fsreq_setbuf *) (buf + i*PGSIZE);
+		if (!((uvpd[PDX(req)] & PTE_P) && (uvpt[PGNUM(req)] & PTE_P))
+		    && (r = sys_page_alloc(0, req, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			return r;
+		req->req_fileid = fd->fd_file.id;
+		req->req_page = i;
+		if ((r = fsipc_page(FSREQ_SETBUF, req, NULL)) < 0) {
+			sys_page_unmap(0, req);
+			return r;
+		}
+	}
+	fd->fd_file.buf_pa = PTE_ADDR(uvpt[PGNUM(req)]);
+	return 0;
+}
+
+// Move up to FSBUF_SIZE bytes between the file and the start of its
+// shared buffer with a single FSREQ_READV or FSREQ_WRITEV.
+static int
+devfile_rwv(struct Fd *fd, unsigned type, size_t n)
+{
+	fsipcbuf.rwv.req_fileid = fd->fd_file.id;
+	fsipcbuf.rwv.req_niov = 1;
+	fsipcbuf.rwv.req_iov[0].iov_off = 0;
+	fsipcbuf.rwv.req_iov[0].iov_len = MIN(n, FSBUF_SIZE);
+	return fsipc(type, NULL);
+}
+
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
 //
 // Returns:
@@ -117,6 +236,20 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// system server.
 	int r;
 
+	// Large reads go through the shared buffer, FSBUF_SIZE at a time.
+	if (n > PGSIZE) {
+		devfile_buf_lock(fd);
+		if ((r = devfile_setbuf(fd)) == 0) {
+			if ((r = devfile_rwv(fd, FSREQ_READV, n)) >= 0) {
+				assert(r <= n);
+				memmove(buf, fd2data(fd), r);
+			}
+			devfile_buf_unlock(fd);
+			return r;
+		}
+		devfile_buf_unlock(fd);
+	}
+
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
 	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
@@ -127,6 +260,29 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	return r;
 }
 
+// Map the page of file 'fdnum' that starts at byte 'offset', which must
+// be page-aligned, read-only at 'dstva'.  The page is the file server's
+// block cache page, so nothing is copied.  The fd's seek position is
+// not used or changed.  Unmap the page when done with it.
+//
+// Returns:
+//	The number of file bytes in the page, 0 at end of file.
+//	-E_NOT_SUPP if 'fdnum' is not a file.
+//	< 0 on other errors.
+ssize_t
+read_map(int fdnum, off_t offset, void *dstva)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	fsipcbuf.read_map.req_fileid = fd->fd_file.id;
+	fsipcbuf.read_map.req_offset = offset;
+	return fsipc(FSREQ_READ_MAP, dstva);
+}
 
 // Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
 //
@@ -142,6 +298,21 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	// panic("devfile_write not implemented");
+	int r;
+
+	if (n > sizeof(fsipcbuf.write.req_buf)) {
+		devfile_buf_lock(fd);
+		if ((r = devfile_setbuf(fd)) == 0) {
+			n = MIN(n, FSBUF_SIZE);
+			memmove(fd2data(fd), buf, n);
+			r = devfile_rwv(fd, FSREQ_WRITEV, n);
+			devfile_buf_unlock(fd);
+			return r;
+		}
+		devfile_buf_unlock(fd);
+	}
+
+	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
 	memmove(fsipcbuf.write.req_buf, buf, n);
@@ -173,6 +344,16 @@ devfile_trunc(struct Fd *fd, off_t newsize)
 }
 
 
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
 // Synchronize disk with buffer cache
 int
 sync(void)
@@ -183,3 +364,159 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Fetch the file server's block cache counters into *st.  If cap is not
+// 0, first make the cache hold at most cap blocks.
+int
+fsstats(uint32_t cap, struct BcStats *st)
+{
+	int r;
+
+	fsipcbuf.stats.req_cap = cap;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet.ret_bc;
+	return 0;
+}
+
+// Fetch the file server's directory entry cache counters into *st.
+int
+fsdcstats(struct DcStats *st)
+{
+	int r;
+
+	fsipcbuf.stats.req_cap = 0;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet.ret_dc;
+	return 0;
+}
+
+// Find a hole of 'len' bytes in the mmap area.  Returns its address, or
+// NULL if there is none.
+static char *
+mmap_findva(size_t len)
+{
+	char *va = (char *) MMAPBASE;
+	int i;
+
+again:
+	if ((uintptr_t) va + len > MMAPTOP)
+		return NULL;
+	for (i = 0; i < MAXMMAP; i++)
+		if (mmaps[i].m_addr && mmaps[i].m_addr < va + len
+		    && va < mmaps[i].m_addr + mmaps[i].m_len) {
+			va = mmaps[i].m_addr + mmaps[i].m_len;
+			goto again;
+		}
+	return va;
+}
+
+// Map 'len' bytes of file 'fdnum' from 'offset', which must be
+// page-aligned, into our address space.  The pages are the file
+// server's block cache pages, shared with PTE_SHARE, so every env that
+// maps the file sees the same data.  With PROT_WRITE, the file must be
+// open for writing; call msync to write changes to disk.  The range
+// must lie within the file.  The mapping outlives the fd, but msync
+// needs the file to be open.
+//
+// Returns the address of the mapping, or NULL on error.
+void *
+mmap(int fdnum, off_t offset, size_t len, int prot)
+{
+	struct Fd *fd;
+	struct Mmap *m = NULL;
+	char *va;
+	size_t i;
+	int r;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+		return NULL;
+	if (offset < 0 || PGOFF(offset) != 0 || len == 0)
+		return NULL;
+	len = ROUNDUP(len, PGSIZE);
+	for (i = 0; i < MAXMMAP && !m; i++)
+		if (!mmaps[i].m_addr)
+			m = &mmaps[i];
+	if (!m || !(va = mmap_findva(len)))
+		return NULL;
+
+	for (i = 0; i < len; i += PGSIZE) {
+		fsipcbuf.mmap.req_fileid = fd->fd_file.id;
+		fsipcbuf.mmap.req_offset = offset + i;
+		fsipcbuf.mmap.req_write = (prot & PROT_WRITE) != 0;
+		if ((r = fsipc(FSREQ_MMAP, va + i)) <= 0) {
+			while (i > 0) {
+				i -= PGSIZE;
+				sys_page_unmap(0, va + i);
+			}
+			return NULL;
+		}
+	}
+
+	m->m_addr = va;
+	m->m_len = len;
+	m->m_fileid = fd->fd_file.id;
+	m->m_offset = offset;
+	m->m_prot = prot;
+	return va;
+}
+
+// Unmap the mapping at 'addr' made by mmap, without writing it back.
+// Returns 0 on success, -E_INVAL if there is no such mapping.
+int
+munmap(void *addr)
+{
+	size_t i;
+	int j;
+
+	for (j = 0; j < MAXMMAP; j++)
+		if (mmaps[j].m_addr && mmaps[j].m_addr == addr)
+			break;
+	if (j == MAXMMAP)
+		return -E_INVAL;
+	for (i = 0; i < mmaps[j].m_len; i += PGSIZE)
+		sys_page_unmap(0, mmaps[j].m_addr + i);
+	mmaps[j].m_addr = 0;
+	return 0;
+}
+
+// Write the pages of [addr, addr+len) that we have changed, which must
+// lie in one writable mapping, back to disk.  The dirty bits in our own
+// page table say which pages those are; each one's is cleared before
+// the file server writes it, so a store that races with msync is
+// caught by the next call.
+// Returns 0 on success, < 0 on error.
+int
+msync(void *addr, size_t len)
+{
+	struct Mmap *m = NULL;
+	char *va, *end;
+	pte_t pte;
+	int i, r;
+
+	for (i = 0; i < MAXMMAP && !m; i++)
+		if (mmaps[i].m_addr && mmaps[i].m_addr <= (char *) addr
+		    && (char *) addr + len <= mmaps[i].m_addr + mmaps[i].m_len)
+			m = &mmaps[i];
+	if (!m || !(m->m_prot & PROT_WRITE))
+		return -E_INVAL;
+
+	va = ROUNDDOWN((char *) addr, PGSIZE);
+	end = ROUNDUP((char *) addr + len, PGSIZE);
+	while (va < end) {
+		fsipcbuf.msync.req_fileid = m->m_fileid;
+		fsipcbuf.msync.req_n = 0;
+		for (; va < end && fsipcbuf.msync.req_n < FSMSYNC_MAX; va += PGSIZE) {
+			pte = uvpt[PGNUM(va)];
+			if (!(pte & PTE_D))
+				continue;
+			if ((r = sys_page_map(0, va, 0, va, pte & PTE_SYSCALL)) < 0)
+				return r;
+			fsipcbuf.msync.req_blocks[fsipcbuf.msync.req_n++] =
+				(m->m_offset + (va - m->m_addr)) / BLKSIZE;
+		}
+		if (fsipcbuf.msync.req_n > 0 && (r = fsipc(FSREQ_MSYNC, NULL)) < 0)
+			return r;
+	}
+	return 0;
+}
@@ -3,16 +3,28 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 #define PTE_READABLE(pte) (((pte)!=NULL) && ((*pte) & (PTE_P|PTE_U)) == (PTE_P|PTE_U))
 #define PTE_WRITEABLE(pte) (((pte)!=NULL) && ((*pte) & (PTE_P|PTE_U|PTE_W)) == (PTE_P|PTE_U|PTE_W))
 #define PTE_COWABLE(pte) (((pte)!=NULL) && ((*pte) & (PTE_P|PTE_U|PTE_COW)) == (PTE_P|PTE_U|PTE_COW))
 
 void _pgfault_upcall(void);
 
+// Replace the copy-on-write page at addr with a private writable copy.
+static void
+cow_copy(void *addr)
+{
+	if(sys_page_map(0, addr, 0, UTEMP, PTE_P|PTE_U) < 0)
+		panic("Failed to call sys_page_map in pgfault!\n");
+
+	if(sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W) < 0)
+		panic("Failed to call sys_page_alloc in pgfault!\n");
+
+	memcpy(addr, UTEMP, PGSIZE);
+
+	if(sys_page_unmap(0, UTEMP) < 0)
+		panic("Failed to call sys_page_unmap in pgfault!\n");
+}
+
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -53,83 +65,20 @@ pgfault(struct UTrapframe *utf)
 	// LAB 4: Your code here.
 	// panic("pgfault not implemented");
 
-	addr = ROUNDDOWN(addr, PGSIZE);
-
-	if(sys_page_map(0, addr, 0, UTEMP, PTE_P|PTE_U) < 0)
-		panic("Failed to call sys_page_map in pgfault!\n");
-
-	if(sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W) < 0)
-		panic("Failed to call sys_page_alloc in pgfault!\n");
-
-	memcpy(addr, UTEMP, PGSIZE);
-
-	if(sys_page_unmap(0, UTEMP) < 0)
-		panic("Failed to call sys_page_unmap in pgfault!\n");
-}
-
-//
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why do we need to mark ours
-// copy-on-write again if it was already copy-on-write at the beginning of
-// this function?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
-//
-static int
-duppage(envid_t envid, unsigned pn)
-{
-	int r;
-
-	// LAB 4: Your code here.
-	// panic("duppage not implemented");
-	unsigned index_of_uvpd = pn / 1024;
-	unsigned index_of_uvpt = pn % 1024;
-
-	pde_t *pde = (pde_t *)((unsigned)(uvpd) + index_of_uvpd * 4);
-	pte_t *pte = (pte_t *)(((unsigned)(uvpt) | (index_of_uvpd << 12)) + index_of_uvpt * 4);
-
-	void *addr = (void *)(pn * PGSIZE);
-
-	// 处理父子进程共享的页面
-	if(PTE_READABLE(pde) && ((*pte) & PTE_SHARE) == PTE_SHARE) {
-		if(sys_page_map(0, addr, envid, addr, PTE_SYSCALL) < 0) {
-			cprintf("pte: %08x, addr: %08x\n", *pte, addr);
-			panic("Failed to copy page mapping of PTE_SHARE!\n");
-		}
-	}
-	// 处理COW和PTE_W
-	else if(PTE_READABLE(pde) && PTE_READABLE(pte) && (PTE_WRITEABLE(pte) || PTE_COWABLE(pte))) {
-		if(sys_page_map(0, addr, envid, addr, PTE_P|PTE_U|PTE_COW) < 0)
-			panic("Failed to call sys_page_map for cow page for child env!\n");
-		if(sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW) < 0)
-			panic("Failed to call sys_page_map for cow page for parent env!\n");
-	}
-	else if(PTE_READABLE(pde) && PTE_READABLE(pte)) {
-		if(sys_page_map(0, addr, envid, addr, PTE_P|PTE_U) < 0)
-			panic("Failed to call sys_page_map for read-only page!\n");
-	}
-
-	return 0;
+	cow_copy(ROUNDDOWN(addr, PGSIZE));
 }
 
 //
-// User-level fork with copy-on-write.
-// Set up our page fault handler appropriately.
-// Create a child.
-// Copy our address space and page fault handler setup to the child.
-// Then mark the child as runnable and return.
+// Fork with copy-on-write.
+// Set up our page fault handler appropriately, then let the kernel
+// create the child: sys_fork_cow copies our address space copy-on-write,
+// gives the child its own user exception stack and our page fault
+// handler, and marks it runnable.
 //
 // Returns: child's envid to the parent, 0 to the child, < 0 on error.
 // It is also OK to panic on error.
 //
-// Hint:
-//   Use uvpd, uvpt, and duppage.
-//   Remember to fix "thisenv" in the child process.
-//   Neither user exception stack should ever be marked copy-on-write,
-//   so you must allocate a new page for the child's user exception stack.
+// Remember to fix "thisenv" in the child process.
 //
 envid_t
 fork(void)
@@ -141,36 +90,89 @@ fork(void)
 	envid_t envid = 0;
 
 	// 在子进程中
-	if((envid = sys_exofork()) == 0) {
+	if((envid = sys_fork_cow()) == 0) {
 		thisenv = &envs[ENVX(sys_getenvid())];
 		return 0;
 	}
 
 	// 在父进程中
 	if(envid < 0)
-		panic("Failed to call sys_exofork!\n");
+		panic("Failed to call sys_fork_cow: %e\n", envid);
 
-
-	// 拷贝父进程地址空间映射
-	for(uintptr_t addr = 0; addr < USTACKTOP; addr += PGSIZE)
-		duppage(envid, addr / PGSIZE);
-
-	// 为子进程创建user exception stack
-	if(sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W) < 0)
-		panic("Failed to call sys_page_alloc for user exception stack for child env!\n");
-
-	// 设置子进程pgfault_handler
-	sys_env_set_pgfault_upcall(envid, _pgfault_upcall);
-
-	// 使子进程处于可运行状态
-	sys_env_set_status(envid, ENV_RUNNABLE);
 	return envid;
 }
 
-// Challenge!
-int
+// The stack: sfork gives each env a private copy of the pages mapped
+// in [SFORK_STACK, USTACKTOP).
+#define SFORK_STACK	(USTACKTOP - PTSIZE)
+
+// Per-env data, which sfork copies instead of sharing.  The linker
+// script gives the .thisenv section a page of its own.
+extern char thisenv_start[];
+
+//
+// Shared-memory fork.  The child shares every page mapped below
+// SFORK_STACK with us, except the .thisenv page, so writes to globals
+// and the heap are seen by both; the stack and .thisenv are
+// copy-on-write as in fork.  Pages mapped after sfork returns are not
+// shared.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
 sfork(void)
 {
-	panic("sfork not implemented");
-	return -E_INVAL;
+	struct PageBatch child, self;
+	uintptr_t addr;
+	pte_t pte;
+	envid_t envid;
+	int r;
+
+	set_pgfault_handler(pgfault);
+
+	if((envid = sys_exofork()) == 0) {
+		thisenv = &envs[ENVX(sys_getenvid())];
+		return 0;
+	}
+	if(envid < 0)
+		return envid;
+
+	pagebatch_init(&child, 0, envid);
+	pagebatch_init(&self, 0, 0);
+	for(addr = 0; addr < USTACKTOP; addr += PGSIZE) {
+		if(!(uvpd[PDX(addr)] & PTE_P)) {
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = uvpt[PGNUM(addr)];
+		if((pte & (PTE_P|PTE_U)) != (PTE_P|PTE_U))
+			continue;
+
+		if((addr >= SFORK_STACK || addr == (uintptr_t) thisenv_start)
+		   && !(pte & PTE_SHARE) && (pte & (PTE_W|PTE_COW))) {
+			// Private: copy-on-write in both envs.
+			if((r = pagebatch_add(&child, PAGEOP_MAP, (void *) addr, (void *) addr, PTE_P|PTE_U|PTE_COW)) < 0
+			   || (r = pagebatch_add(&self, PAGEOP_MAP, (void *) addr, (void *) addr, PTE_P|PTE_U|PTE_COW)) < 0)
+				panic("sfork: sys_page_batch: %e", r);
+			continue;
+		}
+
+		// NOTE: 共享之前先解除本env的写时复制, 否则之后写入时会和子进程分离
+		if(pte & PTE_COW) {
+			cow_copy((void *) addr);
+			pte = uvpt[PGNUM(addr)];
+		}
+		if((r = pagebatch_add(&child, PAGEOP_MAP, (void *) addr, (void *) addr, pte & PTE_SYSCALL)) < 0)
+			panic("sfork: sys_page_batch: %e", r);
+	}
+
+	// NOTE: 必须先映射子进程再把本env的页面改成写时复制
+	if((r = pagebatch_add(&child, PAGEOP_ALLOC, 0, (void *)(UXSTACKTOP - PGSIZE), PTE_P|PTE_U|PTE_W)) < 0
+	   || (r = pagebatch_flush(&child)) < 0 || (r = pagebatch_flush(&self)) < 0)
+		panic("sfork: sys_page_batch: %e", r);
+	if((r = sys_env_set_pgfault_upcall(envid, _pgfault_upcall)) < 0)
+		panic("sfork: sys_env_set_pgfault_upcall: %e", r);
+	if((r = sys_env_set_status(envid, ENV_RUNNABLE)) < 0)
+		panic("sfork: sys_env_set_status: %e", r);
+	return envid;
 }
@@ -82,12 +82,11 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks in the kernel until 'toenv' receives the message.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
-//   If 'pg' is null, pass sys_ipc_try_send a value that it will understand
+//   If 'pg' is null, pass sys_ipc_send a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
@@ -97,15 +96,58 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if(pg == NULL)
 		pg = (void *)UTOP;
 
-	// 不断尝试直到发送成功
-	while (1) {
-		int32_t ret = syscall(SYS_ipc_try_send, 0, to_env, val, (uint32_t)pg, perm, 0);
-		if(ret == 0)
-			return;
-		if(ret < 0 && ret != -E_IPC_NOT_RECV)
-			panic("Failed to call lib/ipc.c:ipc_send!\n");
-		sys_yield();
-	}
+	// NOTE: 内核会把发送方挂在接收方的等待队列上, 不再需要sys_yield轮询
+	int32_t ret = syscall(SYS_ipc_send, 0, to_env, val, (uint32_t)pg, perm, 0);
+	if(ret < 0)
+		panic("ipc_send: %e", ret);
+}
+
+// Fill in the results of a receive that returned 'r', as ipc_recv does.
+static int32_t
+ipc_result(int32_t r, envid_t *from_env_store, int *perm_store)
+{
+	if (from_env_store != NULL)
+		*from_env_store = r < 0 ? 0 : thisenv->env_ipc_from;
+	if (perm_store != NULL)
+		*perm_store = r < 0 ? 0 : thisenv->env_ipc_perm;
+	return r < 0 ? r : thisenv->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for the reply, which is returned as ipc_recv would, with any page
+// mapped at 'rcv_pg'.  The kernel switches straight to 'to_env', so a
+// request/reply round trip costs one system call on each side.
+// Waits in the kernel while 'to_env' is busy; returns < 0 on error.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+
+	return ipc_result(sys_ipc_call(to_env, val, pg, perm, rcv_pg),
+			  NULL, perm_store);
+}
+
+// Reply to a request from 'to_env' and wait for the next message, as
+// ipc_recv does.  If 'to_env' is not receiving yet, because it sent with
+// ipc_send and has not reached ipc_recv, the kernel queues the reply for
+// its next receive (see sys_ipc_reply) and the receive goes ahead.  The
+// reply is dropped if 'to_env' has exited.  Returns < 0 without
+// receiving if the reply could not be sent or queued.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	if (pg == NULL)
+		pg = (void *) UTOP;
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) UTOP;
+
+	return ipc_result(sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg),
+			  from_env_store, perm_store);
 }
 
 // Find the first environment of the given type.  We'll use this to
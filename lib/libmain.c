@@ -5,7 +5,9 @@
 
 extern void umain(int argc, char **argv);
 
-const volatile struct Env *thisenv;
+// In a page of its own, so that envs created by sfork() each have
+// their own copy (see user/user.ld).
+const volatile struct Env *thisenv __attribute__((section(".thisenv")));
 const char *binaryname = "<unknown>";
 
 void
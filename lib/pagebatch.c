@@ -0,0 +1,47 @@
+// Queue page mapping operations and apply them with one
+// sys_page_batch call per PAGEBATCH_SIZE operations.
+
+#include <inc/lib.h>
+
+void
+pagebatch_init(struct PageBatch *b, envid_t srcenv, envid_t dstenv)
+{
+	b->pb_srcenv = srcenv;
+	b->pb_dstenv = dstenv;
+	b->pb_n = 0;
+}
+
+// Queue an operation (see inc/syscall.h), flushing the batch first if
+// it is full.  Returns 0 on success, < 0 if the flush failed.
+int
+pagebatch_add(struct PageBatch *b, int op, void *srcva, void *dstva, int perm)
+{
+	int r;
+
+	if (b->pb_n == PAGEBATCH_SIZE && (r = pagebatch_flush(b)) < 0)
+		return r;
+	b->pb_ops[b->pb_n].op = op;
+	b->pb_ops[b->pb_n].srcva = srcva;
+	b->pb_ops[b->pb_n].dstva = dstva;
+	b->pb_ops[b->pb_n].perm = perm;
+	b->pb_n++;
+	return 0;
+}
+
+// Apply all queued operations.  Returns 0 on success, or the error of
+// the first operation that failed; the operations after it are dropped.
+int
+pagebatch_flush(struct PageBatch *b)
+{
+	int n, r = 0;
+
+	if (b->pb_n == 0)
+		return 0;
+	n = sys_page_batch(b->pb_srcenv, b->pb_dstenv, b->pb_ops, b->pb_n, &r);
+	if (n >= 0 && n < b->pb_n && r == 0)
+		r = -E_INVAL;
+	else if (n < 0)
+		r = n;
+	b->pb_n = 0;
+	return r;
+}
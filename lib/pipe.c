@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
@@ -17,12 +18,25 @@ struct Dev devpipe =
 	.dev_stat =	devpipe_stat,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// The ring takes most of the fd data area; the header shares its
+// first page.  Must be a power of two so the positions can wrap.
+#define PIPEBUFSIZ	(8*PGSIZE)
+#define PIPEPAGES	(ROUNDUP(sizeof(struct Pipe), PGSIZE) / PGSIZE)
 
+// One reader and one writer at a time; neither takes a lock.  Each side
+// only advances its own position, and only after the bytes it covers
+// are copied.  A side that finds the ring empty or full sleeps in
+// sys_futex_wait on p_seq, which both sides bump after every change.
+//
+// p_seq lives after the ring, in the pipe's last page, so that
+// devpipe_close can still wake the other side after it has unmapped the
+// first page, which is what _pipeisclosed looks at.
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
+	volatile uint32_t p_rpos;	// read position
+	volatile uint32_t p_wpos;	// write position
 	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	volatile uint32_t p_seq;	// bumped on every change, to sleep on
+	volatile uint32_t p_waiting;	// someone may be asleep on p_seq
 };
 
 int
@@ -30,7 +44,9 @@ pipe(int pfd[2])
 {
 	int r;
 	struct Fd *fd0, *fd1;
-	void *va;
+	struct PageBatch b;
+	char *va;
+	int i;
 
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
@@ -41,11 +57,16 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
+	// allocate the pipe structure in the data area of both
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+	pagebatch_init(&b, 0, 0);
+	for (i = 0; i < PIPEPAGES; i++)
+		if ((r = pagebatch_add(&b, PAGEOP_ALLOC, 0, va + i*PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+	for (i = 0; i < PIPEPAGES; i++)
+		if ((r = pagebatch_add(&b, PAGEOP_MAP, va + i*PGSIZE, fd2data(fd1) + i*PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err3;
+	if ((r = pagebatch_flush(&b)) < 0)
 		goto err3;
 
 	// set up fd structures
@@ -63,7 +84,10 @@ pipe(int pfd[2])
 	return 0;
 
     err3:
-	sys_page_unmap(0, va);
+	for (i = 0; i < PIPEPAGES; i++) {
+		sys_page_unmap(0, va + i*PGSIZE);
+		sys_page_unmap(0, fd2data(fd1) + i*PGSIZE);
+	}
     err2:
 	sys_page_unmap(0, fd1);
     err1:
@@ -101,11 +125,36 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Note a change to the pipe and wake anyone asleep on it.
+static void
+pipe_wake(struct Pipe *p)
+{
+	// The locked increment orders our position update before the read
+	// of p_waiting; see pipe_wait.
+	asm volatile("lock; incl %0" : "+m" (p->p_seq) : : "cc", "memory");
+	if (p->p_waiting) {
+		p->p_waiting = 0;
+		sys_futex_wake(&p->p_seq);
+	}
+}
+
+// Sleep until the pipe changes, unless it has already changed since
+// p_seq was 'seq'.  Setting p_waiting with xchg orders it before the
+// kernel's read of p_seq, so either pipe_wake sees it or we see the
+// new p_seq.
+static void
+pipe_wait(struct Pipe *p, uint32_t seq)
+{
+	xchg(&p->p_waiting, 1);
+	sys_futex_wait(&p->p_seq, seq);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
-	size_t i;
+	uint32_t seq, rpos, avail;
+	size_t m, off;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -113,34 +162,40 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
-		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+	while (1) {
+		seq = p->p_seq;
+		rpos = p->p_rpos;
+		if ((avail = p->p_wpos - rpos) > 0)
+			break;
+		// pipe is empty
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		if (debug)
+			cprintf("devpipe_read wait\n");
+		pipe_wait(p, seq);
 	}
-	return i;
+
+	// Copy out at most two runs: to the end of the ring, then from
+	// its start.  Wait to advance rpos until the bytes are taken!
+	buf = vbuf;
+	n = MIN(n, avail);
+	off = rpos % PIPEBUFSIZ;
+	m = MIN(n, PIPEBUFSIZ - off);
+	memcpy(buf, p->p_buf + off, m);
+	memcpy(buf + m, p->p_buf, n - m);
+	asm volatile("" : : : "memory");
+	p->p_rpos = rpos + n;
+	pipe_wake(p);
+	return n;
 }
 
 static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
-	size_t i;
+	uint32_t seq, wpos, space;
+	size_t i, m, off;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,23 +204,32 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	for (i = 0; i < n; i += m) {
+		seq = p->p_seq;
+		wpos = p->p_wpos;
+		if ((space = PIPEBUFSIZ - (wpos - p->p_rpos)) == 0) {
 			// pipe is full
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
 			if (_pipeisclosed(fd, p))
 				return 0;
-			// yield and see what happens
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			pipe_wait(p, seq);
+			m = 0;
+			continue;
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// Copy in at most two runs, as in devpipe_read.
+		// Wait to advance wpos until the bytes are stored!
+		m = MIN(n - i, space);
+		off = wpos % PIPEBUFSIZ;
+		memcpy(p->p_buf + off, buf + i, MIN(m, PIPEBUFSIZ - off));
+		if (m > PIPEBUFSIZ - off)
+			memcpy(p->p_buf, buf + i + (PIPEBUFSIZ - off), m - (PIPEBUFSIZ - off));
+		asm volatile("" : : : "memory");
+		p->p_wpos = wpos + m;
+		pipe_wake(p);
 	}
 
 	return i;
@@ -185,7 +249,15 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	int i;
+
+	// Unmap the fd page, then the pipe's first page, so that a peer
+	// woken here finds the pipe closed (see _pipeisclosed).
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	(void) sys_page_unmap(0, p);
+	pipe_wake(p);
+	for (i = 1; i < PIPEPAGES; i++)
+		(void) sys_page_unmap(0, (char*) p + i*PGSIZE);
+	return 0;
 }
-
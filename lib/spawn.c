@@ -54,8 +54,8 @@ spawn(const char *prog, const char **argv)
 	//        so that multiple instances of the same program
 	//	  will share the same copy of the program text.
 	//        Be sure to map the program text read-only in the child.
-	//        Read_map is like read but returns a pointer to the data in
-	//        *blk rather than copying the data into another buffer.
+	//        (We use mmap(), which maps a whole range of the file
+	//        server's pages at once.)
 	//
 	//	* If the ELF segment flags DO include ELF_PROG_FLAG_WRITE,
 	//	  then the segment contains read/write data and bss.
@@ -264,8 +264,9 @@ static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	struct PageBatch batch, stage;
+	char *text;
+	int i, j, n, r;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -276,25 +277,63 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
+	// Page operations on the child are batched; file data is read
+	// PAGEBATCH_SIZE pages at a time into a staging area at UTEMP.
+	pagebatch_init(&batch, 0, child);
+	pagebatch_init(&stage, 0, 0);
+	for (i = 0; i < memsz; i += n * PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			n = 1;
+			if ((r = pagebatch_add(&batch, PAGEOP_ALLOC, 0, (void*) (va + i), perm)) < 0)
 				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
+			continue;
+		}
+
+		// Read-only pages are the file server's block cache pages,
+		// mmapped here and mapped on into the child, so every
+		// instance of a program shares one copy of its text.  A last
+		// page that is only partly file data is shared too when it
+		// holds no bss; no other segment can share the page.
+		n = (memsz <= filesz ? ROUNDUP(filesz - i, PGSIZE) :
+		     ROUNDDOWN(filesz - i, PGSIZE)) / PGSIZE;
+		if (!(perm & PTE_W) && PGOFF(fileoffset) == 0 && n > 0
+		    && (text = mmap(fd, fileoffset + i, n * PGSIZE, PROT_READ)) != NULL) {
+			for (j = 0; j < n; j++)
+				if ((r = pagebatch_add(&batch, PAGEOP_MAP, text + j * PGSIZE,
+						       (void*) (va + i + j * PGSIZE), perm)) < 0)
+					panic("spawn: sys_page_map text: %e", r);
+			if ((r = pagebatch_flush(&batch)) < 0)
+				panic("spawn: sys_page_map text: %e", r);
+			munmap(text);
+			continue;
+		}
+
+		// from file
+		n = MIN(PAGEBATCH_SIZE, ROUNDUP(filesz - i, PGSIZE) / PGSIZE);
+		for (j = 0; j < n; j++)
+			if ((r = pagebatch_add(&stage, PAGEOP_ALLOC, 0, UTEMP + j * PGSIZE,
+					       PTE_P|PTE_U|PTE_W)) < 0)
 				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
+		if ((r = pagebatch_flush(&stage)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		for (j = 0; j < n; j++)
+			if ((r = pagebatch_add(&batch, PAGEOP_MAP, UTEMP + j * PGSIZE,
+					       (void*) (va + i + j * PGSIZE), perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
+		if ((r = pagebatch_flush(&batch)) < 0)
+			panic("spawn: sys_page_map data: %e", r);
+		for (j = 0; j < n; j++)
+			if ((r = pagebatch_add(&stage, PAGEOP_UNMAP, 0, UTEMP + j * PGSIZE, 0)) < 0)
+				panic("spawn: sys_page_unmap: %e", r);
+		if ((r = pagebatch_flush(&stage)) < 0)
+			panic("spawn: sys_page_unmap: %e", r);
 	}
-	return 0;
+	return pagebatch_flush(&batch);
 }
 
 // Copy the mappings for shared pages into the child address space.
@@ -302,15 +341,23 @@ static int
 copy_shared_pages(envid_t child)
 {
 	// LAB 5: Your code here.
-	for(uint32_t addr = 0; addr < UTOP; addr += PGSIZE) {
-		pde_t pde = uvpd[PDX(addr)];
-		pte_t pte = uvpt[PGNUM(addr)];
-
-		if((pde & PTE_P) == PTE_P && (pte & PTE_SHARE) == PTE_SHARE) {
-			if(sys_page_map(0, (void*)addr, child, (void *)addr, pte | PTE_SYSCALL) < 0)
-				panic("Failed to copy page mappings of PTE_SHARE in copy_shared_pages\n");
+	struct PageBatch batch;
+	uintptr_t addr;
+	pte_t pte;
+	int r;
+
+	pagebatch_init(&batch, 0, child);
+	for (addr = 0; addr < UTOP; addr += PGSIZE) {
+		if (!(uvpd[PDX(addr)] & PTE_P)) {
+			addr += PTSIZE - PGSIZE;
+			continue;
 		}
+		pte = uvpt[PGNUM(addr)];
+		if ((pte & (PTE_P|PTE_SHARE)) != (PTE_P|PTE_SHARE))
+			continue;
+		if ((r = pagebatch_add(&batch, PAGEOP_MAP, (void *) addr, (void *) addr,
+				       pte & PTE_SYSCALL)) < 0)
+			return r;
 	}
-	return 0;
+	return pagebatch_flush(&batch);
 }
-
@@ -2,34 +2,79 @@
 
 #include <inc/syscall.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
-static inline int32_t
-syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+// System calls that use a fifth argument.  The sysenter stub needs SI
+// for its resume address, so these always go through int $T_SYSCALL.
+#define SYSCALL_ARG5	((1 << SYS_page_map) | (1 << SYS_page_batch) | \
+			 (1 << SYS_ipc_call) | (1 << SYS_ipc_reply_recv))
+
+// 1 if the CPU has sysenter/sysexit (the kernel programs the sysenter
+// MSRs whenever it does), 0 if not, -1 until the first system call.
+static int have_sysenter = -1;
+
+static int32_t
+sysenter_syscall(int num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4)
 {
 	int32_t ret;
-
-	// Generic system call: pass system call number in AX,
-	// up to five parameters in DX, CX, BX, DI, SI.
-	// Interrupt kernel with T_SYSCALL.
-	//
-	// The "volatile" tells the assembler not to optimize
-	// this instruction away just because we don't use the
-	// return value.
-	//
-	// The last clause tells the assembler that this can
-	// potentially change the condition codes and arbitrary
-	// memory locations.
-
-	asm volatile("int %1\n"
-		     : "=a" (ret)
-		     : "i" (T_SYSCALL),
-		       "a" (num),
+	uint32_t edx, ecx;
+
+	// Same registers as int $T_SYSCALL for the number and the first
+	// four arguments; the kernel comes back with sysexit, which takes
+	// the resume address from SI and the stack pointer from BP by way
+	// of DX and CX.  BP is the frame pointer and can't be clobbered,
+	// so save it on the stack around the call.
+	asm volatile("pushl %%ebp\n\t"
+		     "movl %%esp, %%ebp\n\t"
+		     "leal 1f, %%esi\n\t"
+		     "sysenter\n"
+		     "1:\tpopl %%ebp\n"
+		     : "=a" (ret), "=d" (edx), "=c" (ecx)
+		     : "a" (num),
 		       "d" (a1),
 		       "c" (a2),
 		       "b" (a3),
-		       "D" (a4),
-		       "S" (a5)
-		     : "cc", "memory");
+		       "D" (a4)
+		     : "esi", "cc", "memory");
+	return ret;
+}
+
+static inline int32_t
+syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	int32_t ret;
+	uint32_t edx;
+
+	if (have_sysenter < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		have_sysenter = (edx & CPUID_FEAT_SEP) != 0;
+	}
+	if (have_sysenter && !(SYSCALL_ARG5 & (1 << num)))
+		ret = sysenter_syscall(num, a1, a2, a3, a4);
+	else {
+		// Generic system call: pass system call number in AX,
+		// up to five parameters in DX, CX, BX, DI, SI.
+		// Interrupt kernel with T_SYSCALL.
+		//
+		// The "volatile" tells the assembler not to optimize
+		// this instruction away just because we don't use the
+		// return value.
+		//
+		// The last clause tells the assembler that this can
+		// potentially change the condition codes and arbitrary
+		// memory locations.
+
+		asm volatile("int %1\n"
+			     : "=a" (ret)
+			     : "i" (T_SYSCALL),
+			       "a" (num),
+			       "d" (a1),
+			       "c" (a2),
+			       "b" (a3),
+			       "D" (a4),
+			       "S" (a5)
+			     : "cc", "memory");
+	}
 
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
@@ -87,6 +132,18 @@ sys_page_unmap(envid_t envid, void *va)
 
 // sys_exofork is inlined in lib.h
 
+envid_t
+sys_fork_cow(void)
+{
+	return syscall(SYS_fork_cow, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_batch(envid_t srcenv, envid_t dstenv, const struct PageOp *ops, int n, int *errp)
+{
+	return syscall(SYS_page_batch, 0, srcenv, dstenv, (uint32_t) ops, n, (uint32_t) errp);
+}
+
 int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -111,9 +168,57 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 1, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_reply, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+
+int
+sys_futex_wait(volatile uint32_t *va, uint32_t val)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) va, val, 0, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *va)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_irq_wait(int irq)
+{
+	return syscall(SYS_irq_wait, 0, irq, 0, 0, 0, 0);
+}
+
+int
+sys_irq_bind(int irq)
+{
+	return syscall(SYS_irq_bind, 0, irq, 0, 0, 0, 0);
+}
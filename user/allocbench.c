@@ -0,0 +1,81 @@
+// Measure block allocation on a nearly full disk.
+//
+// Fills the disk with files, frees the last LEFT blocks written, and
+// times writing a file into the space left.  Finding a free block used
+// to probe every in-use bit from block 0 on; now full groups of the
+// bitmap are skipped and the search starts at a rotating hint.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define LEFT		512
+#define MAXFILL		64
+
+static char buf[BLKSIZE];
+static int nfill[MAXFILL];	// blocks in each fill file
+
+static void
+fill_path(char *path, int i)
+{
+	strcpy(path, "/allocbench.fill00");
+	path[16] = '0' + i / 10;
+	path[17] = '0' + i % 10;
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	uint64_t start;
+	uint32_t kcycles;
+	int fd, i, k, n, nfiles, r;
+
+	memset(buf, 0x5A, sizeof(buf));
+	for (nfiles = 0, r = 0; r != -E_NO_DISK; nfiles++) {
+		if (nfiles == MAXFILL)
+			panic("allocbench: disk too large");
+		fill_path(path, nfiles);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", path, fd);
+		for (n = 0; n < MAXFILESIZE / BLKSIZE; n++)
+			if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+				break;
+		if (r < 0 && r != -E_NO_DISK)
+			panic("write: %e", r);
+		nfill[nfiles] = n;
+		close(fd);
+	}
+
+	// Free the last LEFT blocks written.
+	for (i = nfiles - 1, n = LEFT; i >= 0 && n > 0; i--) {
+		fill_path(path, i);
+		if ((fd = open(path, O_WRONLY)) < 0)
+			panic("open %s: %e", path, fd);
+		k = MIN(n, nfill[i]);
+		nfill[i] -= k;
+		n -= k;
+		ftruncate(fd, nfill[i] * BLKSIZE);
+		close(fd);
+	}
+	cprintf("allocbench: disk full with %d files, %d blocks freed\n",
+		nfiles, LEFT - n);
+
+	if ((fd = open("/allocbench", O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open: %e", fd);
+	start = read_tsc();
+	for (n = 0; n < LEFT / 2; n++)
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	kcycles = (read_tsc() - start) >> 10;
+	cprintf("allocbench: %d blocks written on a nearly full disk: %u Kcycles per block\n",
+		LEFT / 2, kcycles / (LEFT / 2));
+
+	ftruncate(fd, 0);
+	close(fd);
+	for (i = 0; i < nfiles; i++) {
+		fill_path(path, i);
+		if ((fd = open(path, O_WRONLY|O_TRUNC)) >= 0)
+			close(fd);
+	}
+	cprintf("allocbench: done\n");
+}
@@ -0,0 +1,84 @@
+// Check that the file server's block cache stays within its cap, and
+// measure how it behaves when a file does not fit.
+//
+// Writes a file of NBLOCKS blocks with the cache capped at CAP blocks,
+// then reads it back twice, checking the data and printing the cache
+// counters after each pass.  Nearly every block of the second pass
+// has to come from disk again: CLOCK evicts each block before the scan
+// comes back to it.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define CAP	64
+#define NBLOCKS	256
+
+static char buf[BLKSIZE];
+
+static void
+report(const char *what, uint64_t start)
+{
+	struct BcStats st;
+	int r;
+
+	if ((r = fsstats(0, &st)) < 0)
+		panic("fsstats: %e", r);
+	cprintf("bcbench: %s: %u Kcycles, cached %u/%u, hits %u, misses %u, "
+		"readahead %u, evictions %u, writebacks %u\n",
+		what, (uint32_t) ((read_tsc() - start) >> 10),
+		st.bc_cached, st.bc_cap, st.bc_hits, st.bc_misses,
+		st.bc_readahead, st.bc_evictions, st.bc_writebacks);
+	if (st.bc_cached > st.bc_cap)
+		panic("bcbench: cache holds %u blocks, cap is %u",
+		      st.bc_cached, st.bc_cap);
+}
+
+static void
+fill(int i)
+{
+	int j;
+
+	for (j = 0; j < BLKSIZE / sizeof(int); j++)
+		((int *) buf)[j] = i * 1024 + j;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStats old;
+	uint64_t start;
+	int fd, i, pass, r;
+	char check[BLKSIZE];
+
+	if ((r = fsstats(CAP, &old)) < 0)
+		panic("fsstats: %e", r);
+
+	if ((fd = open("/bcbench", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /bcbench: %e", fd);
+	start = read_tsc();
+	for (i = 0; i < NBLOCKS; i++) {
+		fill(i);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	}
+	report("write", start);
+
+	for (pass = 0; pass < 2; pass++) {
+		seek(fd, 0);
+		start = read_tsc();
+		for (i = 0; i < NBLOCKS; i++) {
+			if ((r = readn(fd, check, BLKSIZE)) != BLKSIZE)
+				panic("read: %d %e", r, r >= 0 ? 0 : r);
+			fill(i);
+			if (memcmp(buf, check, BLKSIZE) != 0)
+				panic("bcbench: block %d reads back wrong", i);
+		}
+		report("read", start);
+	}
+	ftruncate(fd, 0);
+	close(fd);
+
+	if ((r = fsstats(old.bc_cap, &old)) < 0)
+		panic("fsstats: %e", r);
+	cprintf("bcbench: done\n");
+}
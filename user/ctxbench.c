@@ -0,0 +1,48 @@
+// Measure context switch cost with an IPC ping-pong between two envs,
+// plus sys_yield with nothing else runnable (no address space switch).
+//
+// Run with CPUS=1 so that every round trip is two real switches.
+// Build with DEFS=-DJOS_NO_PGE to compare against non-global kernel
+// mappings.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t cycles;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++)
+		sys_yield();
+	cycles = read_tsc() - start;
+	cprintf("ctxbench: %u cycles per sys_yield to self\n", cycles / NROUND);
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		for (i = 0; i < NROUND; i++)
+			ipc_send(thisenv->env_parent_id, ipc_recv(0, 0, 0), 0, 0);
+		return;
+	}
+
+	// One untimed round trip to fault in both envs' pages.
+	ipc_send(who, 0, 0, 0);
+	ipc_recv(0, 0, 0);
+
+	start = read_tsc();
+	for (i = 1; i < NROUND; i++) {
+		ipc_send(who, i, 0, 0);
+		if (ipc_recv(0, 0, 0) != i)
+			panic("ctxbench: bad reply");
+	}
+	cycles = read_tsc() - start;
+	cprintf("ctxbench: %u cycles per IPC round trip\n", cycles / (NROUND - 1));
+	cprintf("ctxbench: done\n");
+}
@@ -0,0 +1,47 @@
+// Measure repeated path lookups, as a shell running commands makes.
+//
+// Opens the same handful of paths, some of which do not exist, over and
+// over, and reports the directory entry cache hit rate and the cost of
+// an open.  Once the cache has seen a name, looking it up again does not
+// search the directory.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	500
+
+static const char *paths[] = {
+	"/sh", "/ls", "/cat", "/echo", "/motd", "/newmotd",
+	"/nosuchfile", "/sh.missing",
+};
+
+void
+umain(int argc, char **argv)
+{
+	struct DcStats before, after;
+	uint64_t start;
+	uint32_t kcycles, hits, lookups;
+	int fd, i, k, r;
+
+	if ((r = fsdcstats(&before)) < 0)
+		panic("fsdcstats: %e", r);
+	start = read_tsc();
+	for (k = 0; k < NROUND; k++)
+		for (i = 0; i < ARRAY_SIZE(paths); i++)
+			if ((fd = open(paths[i], O_RDONLY)) >= 0)
+				close(fd);
+			else if (fd != -E_NOT_FOUND)
+				panic("open %s: %e", paths[i], fd);
+	kcycles = (read_tsc() - start) >> 10;
+	if ((r = fsdcstats(&after)) < 0)
+		panic("fsdcstats: %e", r);
+
+	hits = after.dc_hits - before.dc_hits;
+	lookups = hits + after.dc_misses - before.dc_misses;
+	cprintf("dcbench: %d opens: %u Kcycles per open\n",
+		NROUND * ARRAY_SIZE(paths), kcycles / (NROUND * ARRAY_SIZE(paths)));
+	cprintf("dcbench: %u lookups, %u hits (%u negative), hit rate %u%%\n",
+		lookups, hits, after.dc_neghits - before.dc_neghits,
+		lookups ? hits * 100 / lookups : 0);
+	cprintf("dcbench: done\n");
+}
@@ -0,0 +1,86 @@
+// Measure opening files in a directory with NENT entries.
+//
+// Creates NENT empty files in the root directory and times opening
+// NOPEN of them picked at random, and looking up as many names that
+// are not there.  A lookup used to compare the name against every slot
+// of the directory; with the hashed directory index it only reads the
+// bucket for the name's hash and the slots it lists.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NENT	10000
+#define NOPEN	2000
+
+static uint32_t seed = 1;
+
+static uint32_t
+rand(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 8;
+}
+
+static void
+ent_path(char *path, const char *prefix, int i)
+{
+	int k;
+
+	strcpy(path, prefix);
+	path += strlen(path);
+	for (k = 4; k >= 0; k--, i /= 10)
+		path[k] = '0' + i % 10;
+	path[5] = '\0';
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	uint64_t start;
+	uint32_t kcycles;
+	int fd, i, r;
+
+	start = read_tsc();
+	for (i = 0; i < NENT; i++) {
+		ent_path(path, "/dirbench.", i);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL)) < 0)
+			panic("open %s: %e", path, fd);
+		close(fd);
+	}
+	kcycles = (read_tsc() - start) >> 10;
+	cprintf("dirbench: %d files created: %u Kcycles per create\n",
+		NENT, kcycles / NENT);
+
+	start = read_tsc();
+	for (i = 0; i < NOPEN; i++) {
+		ent_path(path, "/dirbench.", rand() % NENT);
+		if ((fd = open(path, O_RDONLY)) < 0)
+			panic("open %s: %e", path, fd);
+		close(fd);
+	}
+	kcycles = (read_tsc() - start) >> 10;
+	cprintf("dirbench: %d random opens: %u Kcycles per open\n",
+		NOPEN, kcycles / NOPEN);
+
+	start = read_tsc();
+	for (i = 0; i < NOPEN; i++) {
+		ent_path(path, "/dirbench.missing.", rand() % NENT);
+		if ((r = open(path, O_RDONLY)) != -E_NOT_FOUND)
+			panic("open %s: %e", path, r);
+	}
+	kcycles = (read_tsc() - start) >> 10;
+	cprintf("dirbench: %d failed opens: %u Kcycles per open\n",
+		NOPEN, kcycles / NOPEN);
+
+	start = read_tsc();
+	for (i = 0; i < NENT; i++) {
+		ent_path(path, "/dirbench.", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	kcycles = (read_tsc() - start) >> 10;
+	cprintf("dirbench: %d files removed: %u Kcycles per remove\n",
+		NENT, kcycles / NENT);
+	cprintf("dirbench: done\n");
+}
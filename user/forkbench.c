@@ -0,0 +1,74 @@
+// Measure fork latency as the parent's address space grows, and the
+// time to build a forktree-style binary tree of envs.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFORK	20
+#define DEPTH	5
+
+static uint8_t *heap = (uint8_t *) 0x10000000;
+
+static uint32_t
+measure(void)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t cycles = 0;
+	int i;
+
+	for (i = 0; i < NFORK; i++) {
+		start = read_tsc();
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			exit();
+		cycles += read_tsc() - start;
+		wait(who);
+	}
+	return cycles / NFORK;
+}
+
+// Fork a complete binary tree below us; the leaves report to 'root'.
+static void
+tree(envid_t root, int depth)
+{
+	int i;
+
+	if (depth == DEPTH) {
+		ipc_send(root, 0, 0, 0);
+		return;
+	}
+	for (i = 0; i < 2; i++)
+		if (fork() == 0) {
+			tree(root, depth + 1);
+			exit();
+		}
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const int sizes[] = { 0, 64, 256, 1024 };
+	uint64_t start;
+	int i, n, npages = 0, r;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		for (; npages < sizes[i]; npages++) {
+			if ((r = sys_page_alloc(0, heap + npages * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+			heap[npages * PGSIZE] = npages;
+		}
+		cprintf("forkbench: %4d extra pages: %u cycles per fork\n",
+			npages, measure());
+	}
+
+	start = read_tsc();
+	tree(thisenv->env_id, 0);
+	for (n = 0; n < (1 << DEPTH); n++)
+		ipc_recv(0, 0, 0);
+	cprintf("forkbench: tree of %d envs: %u Kcycles\n",
+		(2 << DEPTH) - 1, (uint32_t) ((read_tsc() - start) / 1000));
+	cprintf("forkbench: done\n");
+}
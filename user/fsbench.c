@@ -0,0 +1,61 @@
+// Measure sequential file write and read throughput for several
+// request sizes.
+//
+// Requests larger than a page go through the buffer each open file
+// shares with the file server, so a 64KB read or write is one IPC
+// round trip instead of sixteen or more.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define FILESIZE	(1024*1024)
+
+static char buf[FSBUF_SIZE];
+
+static uint32_t
+rate(uint64_t start)
+{
+	uint32_t kcycles = (read_tsc() - start) >> 10;
+
+	return FILESIZE / MAX(kcycles, 1);
+}
+
+static void
+run(size_t chunk)
+{
+	uint64_t start;
+	uint32_t wrate, rrate;
+	size_t n;
+	int fd, r;
+
+	if ((fd = open("/fsbench", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /fsbench: %e", fd);
+	start = read_tsc();
+	for (n = 0; n < FILESIZE; n += chunk)
+		if ((r = write(fd, buf, chunk)) != chunk)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	wrate = rate(start);
+
+	seek(fd, 0);
+	start = read_tsc();
+	for (n = 0; n < FILESIZE; n += chunk)
+		if ((r = readn(fd, buf, chunk)) != chunk)
+			panic("read: %d %e", r, r >= 0 ? 0 : r);
+	rrate = rate(start);
+	close(fd);
+
+	cprintf("fsbench: %5u-byte requests: write %u, read %u bytes/Kcycle\n",
+		chunk, wrate, rrate);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t chunks[] = { 512, 4096, 16384, FSBUF_SIZE };
+	int i;
+
+	memset(buf, 0x5A, sizeof(buf));
+	for (i = 0; i < ARRAY_SIZE(chunks); i++)
+		run(chunks[i]);
+	cprintf("fsbench: done\n");
+}
@@ -0,0 +1,116 @@
+// Many clients, one server: measure IPC request throughput and latency.
+//
+// Each client issues NREQ ipc_call requests to a single echo server.
+// Busy-server requests queue in the kernel instead of spinning in
+// sys_yield, so tail latency should stay close to (clients x service
+// time) rather than growing with scheduler noise.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NREQ	500
+#define BUCKET	1024		// cycles per histogram bucket
+#define NBUCKET	1000
+
+struct Shared {
+	volatile int go;
+	volatile uint32_t hist[NBUCKET];
+};
+
+// Shared with the clients; see umain.
+static struct Shared *sh = (struct Shared *) (UTEMP + PGSIZE);
+
+static void
+server(void)
+{
+	envid_t whom;
+	int32_t req;
+
+	req = ipc_recv(&whom, 0, 0);
+	while (1)
+		req = ipc_reply_recv(whom, req + 1, 0, 0, &whom, 0, 0);
+}
+
+static void
+client(envid_t srv)
+{
+	uint64_t start;
+	uint32_t lat;
+	int i;
+
+	while (!sh->go)
+		asm volatile("pause");
+	for (i = 0; i < NREQ; i++) {
+		start = read_tsc();
+		if (ipc_call(srv, i, 0, 0, 0, 0) != i + 1)
+			panic("ipcbench: bad reply");
+		lat = (read_tsc() - start) / BUCKET;
+		__sync_fetch_and_add(&sh->hist[MIN(lat, NBUCKET - 1)], 1);
+	}
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+	exit();
+}
+
+// Upper bound, in cycles, of the bucket holding the p'th percentile.
+static uint32_t
+percentile(uint32_t total, int p)
+{
+	uint32_t seen = 0;
+	int i;
+
+	for (i = 0; i < NBUCKET; i++) {
+		seen += sh->hist[i];
+		if ((uint64_t) seen * 100 >= (uint64_t) total * p)
+			break;
+	}
+	return (i + 1) * BUCKET;
+}
+
+static void
+run(envid_t srv, int nclient)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t cycles, total = nclient * NREQ;
+	int i;
+
+	sh->go = 0;
+	memset((void *) sh->hist, 0, sizeof(sh->hist));
+	for (i = 0; i < nclient; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			client(srv);
+	}
+
+	start = read_tsc();
+	sh->go = 1;
+	for (i = 0; i < nclient; i++)
+		ipc_recv(0, 0, 0);
+	cycles = read_tsc() - start;
+
+	cprintf("ipcbench: %2d clients: %u req/Mcycle, p50 < %u, p99 < %u cycles\n",
+		nclient, (uint32_t) ((uint64_t) total * 1000000 / cycles),
+		percentile(total, 50), percentile(total, 99));
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t srv;
+	int n, r;
+
+	static_assert(sizeof(struct Shared) <= PGSIZE);
+	if ((r = sys_page_alloc(0, (void *) sh, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((srv = fork()) < 0)
+		panic("fork: %e", srv);
+	if (srv == 0)
+		server();
+
+	for (n = 1; n <= 32; n *= 2)
+		run(srv, n);
+	sys_env_destroy(srv);
+	cprintf("ipcbench: done\n");
+}
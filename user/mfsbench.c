@@ -0,0 +1,173 @@
+// Measure the file server with 1, 2, 4 and 8 clients reading at once.
+//
+// Each reader reads its own file from a cold block cache, front to
+// back.  While one request waits for the disk, the file server now runs
+// the others, so the aggregate throughput should grow with the number
+// of readers.  A last run adds a reader of a cached block alongside the
+// cold readers and reports how long its reads take; they should not
+// wait behind the disk.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NREADER		8
+#define FILESIZE	(512*1024)
+#define NHOT		2000
+
+// Shared with the readers; set to start them all at once.
+static volatile int *go = (volatile int *) (UTEMP + PGSIZE);
+
+static char buf[BLKSIZE];
+
+static void
+file_path(char *path, int i)
+{
+	strcpy(path, "/mfsbench.0");
+	path[strlen(path) - 1] = '0' + i;
+}
+
+// Empty the block cache by shrinking it to nothing and back.
+static void
+drop_cache(void)
+{
+	struct BcStats st;
+	uint32_t cap;
+	int r;
+
+	if ((r = fsstats(0, &st)) < 0)
+		panic("fsstats: %e", r);
+	cap = st.bc_cap;
+	if ((r = fsstats(1, &st)) < 0 || (r = fsstats(cap, &st)) < 0)
+		panic("fsstats: %e", r);
+}
+
+static void
+cold_reader(int i)
+{
+	char path[MAXPATHLEN];
+	int fd, r;
+
+	file_path(path, i);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	while (!*go)
+		asm volatile("pause");
+	while ((r = read(fd, buf, BLKSIZE)) > 0)
+		/* do nothing */;
+	if (r < 0)
+		panic("read: %e", r);
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+	exit();
+}
+
+// Read the first block of /lorem, which the parent left cached, NHOT
+// times, and send back the mean Kcycles per read.
+static void
+hot_reader(void)
+{
+	uint64_t start;
+	int fd, i, r;
+
+	if ((fd = open("/lorem", O_RDONLY)) < 0)
+		panic("open /lorem: %e", fd);
+	while (!*go)
+		asm volatile("pause");
+	start = read_tsc();
+	for (i = 0; i < NHOT; i++) {
+		seek(fd, 0);
+		if ((r = read(fd, buf, BLKSIZE)) < 0)
+			panic("read: %e", r);
+	}
+	ipc_send(thisenv->env_parent_id,
+		 (uint32_t) ((read_tsc() - start) >> 10) / NHOT, 0, 0);
+	exit();
+}
+
+static void
+run(int nreader, bool hot)
+{
+	envid_t who, hotenv = 0;
+	uint64_t start;
+	uint32_t cycles, v, hotk = 0;
+	int i, fd, r;
+
+	drop_cache();
+	if (hot) {
+		if ((fd = open("/lorem", O_RDONLY)) < 0)
+			panic("open /lorem: %e", fd);
+		if ((r = read(fd, buf, BLKSIZE)) < 0)
+			panic("read: %e", r);
+		close(fd);
+	}
+
+	*go = 0;
+	for (i = 0; i < nreader + hot; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0) {
+			if (i == nreader)
+				hot_reader();
+			cold_reader(i);
+		}
+		if (i == nreader)
+			hotenv = who;
+	}
+
+	start = read_tsc();
+	*go = 1;
+	for (i = 0; i < nreader + hot; i++) {
+		v = ipc_recv(&who, 0, 0);
+		if (hot && who == hotenv)
+			hotk = v;
+	}
+	cycles = read_tsc() - start;
+
+	cprintf("mfsbench: %d readers: %u KB/Mcycle",
+		nreader, (uint32_t) ((uint64_t) FILESIZE * nreader * 1000 / cycles));
+	if (hot)
+		cprintf(", cached reads %u Kcycles", hotk);
+	cprintf("\n");
+}
+
+static void
+make_file(int i)
+{
+	char path[MAXPATHLEN];
+	size_t n;
+	int fd, r;
+
+	file_path(path, i);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	memset(buf, 'a' + i, sizeof(buf));
+	for (n = 0; n < FILESIZE; n += BLKSIZE)
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXPATHLEN];
+	int i, n, r;
+
+	if ((r = sys_page_alloc(0, (void *) go, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (i = 0; i < NREADER; i++)
+		make_file(i);
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+
+	for (n = 1; n <= NREADER; n *= 2)
+		run(n, false);
+	run(NREADER - 1, true);
+
+	for (i = 0; i < NREADER; i++) {
+		file_path(path, i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	cprintf("mfsbench: done\n");
+}
@@ -0,0 +1,46 @@
+// Measure the cost of a null system call (sys_getenvid) in cycles,
+// through int $T_SYSCALL and, if the CPU has it, through sysenter.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALL	100000
+
+static uint32_t
+measure_int(void)
+{
+	uint64_t start;
+	envid_t ret;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		asm volatile("int %1"
+			     : "=a" (ret)
+			     : "i" (T_SYSCALL), "a" (SYS_getenvid)
+			     : "cc", "memory");
+	return (uint32_t) (read_tsc() - start) / NCALL;
+}
+
+static uint32_t
+measure_stub(void)
+{
+	uint64_t start;
+	int i;
+
+	start = read_tsc();
+	for (i = 0; i < NCALL; i++)
+		sys_getenvid();
+	return (uint32_t) (read_tsc() - start) / NCALL;
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	cprintf("nullbench: int $T_SYSCALL: %u cycles/call\n", measure_int());
+	cprintf("nullbench: sys_getenvid (%s): %u cycles/call\n",
+		(edx & CPUID_FEAT_SEP) ? "sysenter" : "int", measure_stub());
+}
@@ -0,0 +1,58 @@
+// Measure pipe bandwidth between two envs for several write sizes.
+//
+// Bytes move with bulk copies through a multi-page ring, and a side
+// that finds the ring empty or full sleeps in the kernel instead of
+// spinning in sys_yield.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define TOTAL	(4*1024*1024)
+
+static char buf[32*1024];
+
+static void
+run(size_t chunk)
+{
+	int p[2], r;
+	size_t n;
+	envid_t who;
+	uint64_t start;
+	uint32_t kcycles;
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		close(p[1]);
+		while ((r = read(p[0], buf, sizeof(buf))) > 0)
+			;
+		if (r < 0)
+			panic("read: %e", r);
+		exit();
+	}
+	close(p[0]);
+
+	start = read_tsc();
+	for (n = 0; n < TOTAL; n += chunk)
+		if ((r = write(p[1], buf, chunk)) != chunk)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	close(p[1]);
+	wait(who);
+	kcycles = (read_tsc() - start) >> 10;
+
+	cprintf("pipebench: %5u-byte writes: %u bytes/Kcycle\n",
+		chunk, (uint32_t) ((uint64_t) TOTAL / MAX(kcycles, 1)));
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t chunks[] = { 4, 64, 512, 4096, 32768 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(chunks); i++)
+		run(chunks[i]);
+	cprintf("pipebench: done\n");
+}
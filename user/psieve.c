@@ -0,0 +1,76 @@
+// Parallel prime sieve with sfork'd workers.
+//
+// The parent finds the primes up to sqrt(N), then NWORKER envs created
+// with sfork sieve disjoint segments of one shared array.  Run with
+// CPUS=n; the time should drop close to linearly up to n workers.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define N		(1 << 20)
+#define SQRTN		1024
+#define MAXWORKER	8
+
+static uint8_t composite[N];	// shared with the workers
+static int base[SQRTN];		// primes below SQRTN
+static int nbase;
+
+static void
+worker(int lo, int hi)
+{
+	int i, p, m;
+
+	for (i = 0; i < nbase; i++) {
+		p = base[i];
+		m = ROUNDUP(MAX(lo, p * p), p);
+		for (; m < hi; m += p)
+			composite[m] = 1;
+	}
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+	exit();
+}
+
+static void
+run(int nworker)
+{
+	uint64_t start;
+	int i, lo, hi, count;
+	envid_t who;
+
+	memset(composite, 0, sizeof(composite));
+	start = read_tsc();
+	for (i = 0; i < nworker; i++) {
+		lo = MAX(SQRTN, N / nworker * i);
+		hi = i == nworker - 1 ? N : N / nworker * (i + 1);
+		if ((who = sfork()) < 0)
+			panic("sfork: %e", who);
+		if (who == 0)
+			worker(lo, hi);
+	}
+	for (i = 0; i < nworker; i++)
+		ipc_recv(0, 0, 0);
+
+	count = nbase;
+	for (i = SQRTN; i < N; i++)
+		count += !composite[i];
+	cprintf("psieve: %d workers: %u Kcycles, %d primes below %d\n",
+		nworker, (uint32_t) ((read_tsc() - start) / 1000), count, N);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, n;
+
+	for (i = 2; i < SQRTN; i++) {
+		for (j = 0; j < nbase && base[j] * base[j] <= i; j++)
+			if (i % base[j] == 0)
+				break;
+		if (j == nbase || base[j] * base[j] > i)
+			base[nbase++] = i;
+	}
+
+	for (n = 1; n <= MAXWORKER; n *= 2)
+		run(n);
+	cprintf("psieve: done\n");
+}
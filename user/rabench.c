@@ -0,0 +1,109 @@
+// Measure cold file reads with and without read-ahead.
+//
+// Each file is read from a cold block cache twice: front to back, which
+// the file server detects as sequential and reads ahead in growing
+// windows, and back to front one block at a time, which gets no
+// read-ahead and costs one disk request per block.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static char buf[BLKSIZE];
+
+// Empty the block cache by shrinking it to nothing and back.
+static uint32_t
+drop_cache(void)
+{
+	struct BcStats st;
+	uint32_t cap;
+	int r;
+
+	if ((r = fsstats(0, &st)) < 0)
+		panic("fsstats: %e", r);
+	cap = st.bc_cap;
+	if ((r = fsstats(1, &st)) < 0 || (r = fsstats(cap, &st)) < 0)
+		panic("fsstats: %e", r);
+	return st.bc_misses + st.bc_readahead;
+}
+
+static uint32_t
+disk_blocks(uint32_t since)
+{
+	struct BcStats st;
+	int r;
+
+	if ((r = fsstats(0, &st)) < 0)
+		panic("fsstats: %e", r);
+	return st.bc_misses + st.bc_readahead - since;
+}
+
+static void
+run(const char *path, size_t size)
+{
+	uint64_t start;
+	uint32_t fwd, back, nfwd, nback, base;
+	int fd, i, nblocks, r;
+
+	nblocks = ROUNDUP(size, BLKSIZE) / BLKSIZE;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+
+	base = drop_cache();
+	start = read_tsc();
+	while ((r = read(fd, buf, BLKSIZE)) > 0)
+		/* do nothing */;
+	if (r < 0)
+		panic("read: %e", r);
+	fwd = (read_tsc() - start) >> 10;
+	nfwd = disk_blocks(base);
+
+	base = drop_cache();
+	start = read_tsc();
+	for (i = nblocks - 1; i >= 0; i--) {
+		seek(fd, i * BLKSIZE);
+		if ((r = read(fd, buf, BLKSIZE)) < 0)
+			panic("read: %e", r);
+	}
+	back = (read_tsc() - start) >> 10;
+	nback = disk_blocks(base);
+	close(fd);
+
+	cprintf("rabench: %8u bytes: forward %u Kcycles (%u blocks read), "
+		"backward %u Kcycles (%u blocks read)\n",
+		size, fwd, nfwd, back, nback);
+}
+
+static void
+make_file(const char *path, size_t size)
+{
+	size_t n;
+	int fd, r;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	memset(buf, 0x5A, sizeof(buf));
+	for (n = 0; n < size; n += BLKSIZE)
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const size_t sizes[] = { 64*1024, 1024*1024, 4*1024*1024 };
+	struct Stat st;
+	int i, r;
+
+	if ((r = stat("/lorem", &st)) < 0)
+		panic("stat /lorem: %e", r);
+	run("/lorem", st.st_size);
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		make_file("/rabench", sizes[i]);
+		run("/rabench", sizes[i]);
+	}
+	if ((r = open("/rabench", O_WRONLY|O_TRUNC)) >= 0)
+		close(r);
+	cprintf("rabench: done\n");
+}
@@ -0,0 +1,73 @@
+// Measure context switch latency as the number of blocked envs grows.
+//
+// Two envs ping-pong with sys_yield while N other envs sit blocked in
+// ipc_recv.  With per-CPU run queues the cost per switch should not
+// depend on N.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NYIELD	2000
+
+static envid_t sleepers[512];
+
+static void
+sleeper(void)
+{
+	ipc_recv(0, 0, 0);
+	exit();
+}
+
+static uint32_t
+measure(void)
+{
+	envid_t partner;
+	uint64_t start;
+	int i;
+
+	if ((partner = fork()) < 0)
+		panic("fork: %e", partner);
+	if (partner == 0) {
+		while (1)
+			sys_yield();
+	}
+
+	// Let the partner get onto a run queue before timing.
+	sys_yield();
+	start = read_tsc();
+	for (i = 0; i < NYIELD; i++)
+		sys_yield();
+	uint32_t cycles = read_tsc() - start;
+
+	sys_env_destroy(partner);
+	return cycles / NYIELD;
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const int counts[] = { 0, 64, 256, 512 };
+	int i, n, nsleep = 0;
+	envid_t who;
+
+	cprintf("schedbench: cycles per sys_yield with two runnable envs\n");
+	for (i = 0; i < ARRAY_SIZE(counts); i++) {
+		for (n = counts[i]; nsleep < n; nsleep++) {
+			if ((who = fork()) < 0)
+				panic("fork: %e", who);
+			if (who == 0)
+				sleeper();
+			sleepers[nsleep] = who;
+		}
+		// Wait until every sleeper has blocked.
+		for (n = 0; n < nsleep; n++)
+			while (envs[ENVX(sleepers[n])].env_status != ENV_NOT_RUNNABLE)
+				sys_yield();
+		cprintf("schedbench: %d blocked envs: %u cycles\n",
+			nsleep, measure());
+	}
+
+	for (n = 0; n < nsleep; n++)
+		sys_env_destroy(sleepers[n]);
+	cprintf("schedbench: done\n");
+}
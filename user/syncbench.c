@@ -0,0 +1,68 @@
+// Measure sync time on a mostly-clean block cache.
+//
+// Fills the cache with clean blocks by reading a large file, then times
+// sync() after dirtying 0, 1, 16 and 256 blocks of another file.  Sync
+// visits only dirty blocks and writes adjacent ones with one disk
+// request, so the cost should follow the number of dirty blocks, not
+// the size of the disk or the cache.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define CLEANSIZE	(4*1024*1024)
+#define MAXDIRTY	256
+
+static char buf[BLKSIZE];
+
+static void
+make_file(const char *path, size_t size)
+{
+	size_t n;
+	int fd, r;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (n = 0; n < size; n += BLKSIZE)
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %d %e", r, r >= 0 ? 0 : r);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const int ndirty[] = { 0, 1, 16, MAXDIRTY };
+	uint64_t start;
+	int fd, i, n, r;
+
+	memset(buf, 0x5A, sizeof(buf));
+	make_file("/syncbench.clean", CLEANSIZE);
+	make_file("/syncbench", MAXDIRTY * BLKSIZE);
+	sync();
+
+	// Bring the large file into the cache clean.
+	if ((fd = open("/syncbench.clean", O_RDONLY)) < 0)
+		panic("open: %e", fd);
+	while ((r = read(fd, buf, BLKSIZE)) > 0)
+		/* do nothing */;
+	close(fd);
+
+	if ((fd = open("/syncbench", O_RDWR)) < 0)
+		panic("open: %e", fd);
+	for (i = 0; i < ARRAY_SIZE(ndirty); i++) {
+		seek(fd, 0);
+		for (n = 0; n < ndirty[i]; n++)
+			if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+				panic("write: %d %e", r, r >= 0 ? 0 : r);
+		start = read_tsc();
+		if ((r = sync()) < 0)
+			panic("sync: %e", r);
+		cprintf("syncbench: %3d dirty blocks: sync %u Kcycles\n",
+			ndirty[i], (uint32_t) ((read_tsc() - start) >> 10));
+	}
+	ftruncate(fd, 0);
+	close(fd);
+	if ((fd = open("/syncbench.clean", O_WRONLY|O_TRUNC)) >= 0)
+		close(fd);
+	cprintf("syncbench: done\n");
+}
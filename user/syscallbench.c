@@ -0,0 +1,74 @@
+// Measure system call throughput with 1, 2, 4 and 8 envs issuing
+// system calls in parallel.
+//
+// Run with CPUS=n.  Without a big kernel lock, throughput should grow
+// nearly linearly until the number of envs reaches the number of CPUs.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NITER	20000
+
+// Shared with the workers; set to start them all at once.
+static volatile int *go = (volatile int *) (UTEMP + PGSIZE);
+
+static void
+worker(int kind)
+{
+	int i;
+
+	while (!*go)
+		asm volatile("pause");
+	for (i = 0; i < NITER; i++) {
+		if (kind == 0)
+			sys_getenvid();
+		else {
+			sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W);
+			sys_page_unmap(0, UTEMP);
+		}
+	}
+	ipc_send(thisenv->env_parent_id, 0, 0, 0);
+	exit();
+}
+
+static void
+run(int kind, int nworker)
+{
+	envid_t who;
+	uint64_t start;
+	uint32_t cycles;
+	int i;
+
+	*go = 0;
+	for (i = 0; i < nworker; i++) {
+		if ((who = fork()) < 0)
+			panic("fork: %e", who);
+		if (who == 0)
+			worker(kind);
+	}
+
+	start = read_tsc();
+	*go = 1;
+	for (i = 0; i < nworker; i++)
+		ipc_recv(0, 0, 0);
+	cycles = read_tsc() - start;
+
+	cprintf("syscallbench: %s x %d envs: %u calls/Mcycle\n",
+		kind == 0 ? "getenvid" : "page_alloc+unmap", nworker,
+		(uint32_t) ((uint64_t) NITER * nworker * 1000000 / cycles));
+}
+
+void
+umain(int argc, char **argv)
+{
+	int kind, n;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) go, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	for (kind = 0; kind < 2; kind++)
+		for (n = 1; n <= 8; n *= 2)
+			run(kind, n);
+	cprintf("syscallbench: done\n");
+}
@@ -98,11 +98,11 @@ umain(int argc, char **argv)
 		panic("open did not fill struct Fd correctly\n");
 	cprintf("open is good\n");
 
-	// Try files with indirect blocks
+	// Try a file that spans many blocks
 	if ((f = open("/big", O_WRONLY|O_CREAT)) < 0)
 		panic("creat /big: %e", f);
 	memset(buf, 0, sizeof(buf));
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < 30*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = write(f, buf, sizeof(buf))) < 0)
 			panic("write /big@%d: %e", i, r);
@@ -111,7 +111,7 @@ umain(int argc, char **argv)
 
 	if ((f = open("/big", O_RDONLY)) < 0)
 		panic("open /big: %e", f);
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < 30*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = readn(f, buf, sizeof(buf))) < 0)
 			panic("read /big@%d: %e", i, r);
@@ -0,0 +1,121 @@
+// Large reads and writes from two envs at once on one inherited fd.
+// Both go through the multi-page buffer the fd shares with the file
+// server, which fork hands to the child along with the fd.  Each read
+// must return bytes from the file, and each write must land whole.
+
+#include <inc/lib.h>
+
+#define RDSIZE	(512*1024)
+#define RDCHUNK	(3*PGSIZE)
+#define WRCHUNK	(8*PGSIZE)
+#define NWRITE	32
+
+static uint32_t buf[WRCHUNK / 4];
+
+// Every word of /testfsbuf.r holds its own offset, so any run of bytes
+// read from it shows whether it came from where it claims.
+static void
+make_rdfile(void)
+{
+	int fd, i, off, r;
+
+	if ((fd = open("/testfsbuf.r", O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open /testfsbuf.r: %e", fd);
+	for (off = 0; off < RDSIZE; off += sizeof(buf)) {
+		for (i = 0; i < ARRAY_SIZE(buf); i++)
+			buf[i] = off + i * 4;
+		if ((r = write(fd, buf, sizeof(buf))) != sizeof(buf))
+			panic("write /testfsbuf.r: %d %e", r, r >= 0 ? 0 : r);
+	}
+	close(fd);
+}
+
+static void
+reader(int fd, const char *who)
+{
+	int i, r;
+
+	while ((r = read(fd, buf, RDCHUNK)) > 0)
+		for (i = 1; i < r / 4; i++)
+			if (buf[i] != buf[0] + i * 4)
+				panic("%s read %08x at +%d after %08x", who,
+				      buf[i], i * 4, buf[0]);
+	if (r < 0)
+		panic("%s read: %e", who, r);
+}
+
+// Write NWRITE chunks, each filled with one word naming the writer and
+// the chunk.
+static void
+writer(int fd, int tag)
+{
+	int i, j, r;
+
+	for (j = 0; j < NWRITE; j++) {
+		for (i = 0; i < ARRAY_SIZE(buf); i++)
+			buf[i] = (tag << 16) | j;
+		if ((r = write(fd, buf, WRCHUNK)) != WRCHUNK)
+			panic("write /testfsbuf.w: %d %e", r, r >= 0 ? 0 : r);
+	}
+}
+
+// Every chunk of /testfsbuf.w must be whole and written exactly once.
+static void
+check_wrfile(void)
+{
+	uint8_t seen[2][NWRITE];
+	int fd, i, j, r;
+
+	memset(seen, 0, sizeof(seen));
+	if ((fd = open("/testfsbuf.w", O_RDONLY)) < 0)
+		panic("open /testfsbuf.w: %e", fd);
+	for (j = 0; j < 2 * NWRITE; j++) {
+		if ((r = readn(fd, buf, WRCHUNK)) != WRCHUNK)
+			panic("read /testfsbuf.w: %d %e", r, r >= 0 ? 0 : r);
+		for (i = 1; i < ARRAY_SIZE(buf); i++)
+			if (buf[i] != buf[0])
+				panic("chunk %d is torn: %08x, %08x", j, buf[0], buf[i]);
+		if ((buf[0] >> 16) > 1 || (buf[0] & 0xFFFF) >= NWRITE
+		    || seen[buf[0] >> 16][buf[0] & 0xFFFF]++)
+			panic("chunk %d holds %08x", j, buf[0]);
+	}
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int rfd, wfd, r;
+
+	make_rdfile();
+	if ((rfd = open("/testfsbuf.r", O_RDONLY)) < 0)
+		panic("open /testfsbuf.r: %e", rfd);
+	if ((wfd = open("/testfsbuf.w", O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open /testfsbuf.w: %e", wfd);
+
+	// Set up the read fd's buffer before forking, so the child
+	// inherits it, and leave the write fd's for each env to set up.
+	if ((r = read(rfd, buf, RDCHUNK)) != RDCHUNK)
+		panic("read /testfsbuf.r: %d %e", r, r >= 0 ? 0 : r);
+	seek(rfd, 0);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		reader(rfd, "child");
+		writer(wfd, 1);
+		exit();
+	}
+	reader(rfd, "parent");
+	writer(wfd, 0);
+	wait(child);
+	cprintf("concurrent reads are good\n");
+
+	close(wfd);
+	check_wrfile();
+	cprintf("concurrent writes are good\n");
+	close(rfd);
+	remove("/testfsbuf.r");
+	remove("/testfsbuf.w");
+}
@@ -0,0 +1,65 @@
+// Talk to the file server with plain ipc_send and ipc_recv, as old
+// clients do, instead of ipc_call.  With direct-handoff IPC the server
+// can answer before the client has reached ipc_recv; the reply must
+// wait for it rather than be lost.  Several envs do this at once so that
+// they also queue on the busy server.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NROUND	200
+
+#define FVA ((struct Fd*)0xCCCCC000)
+
+extern union Fsipc fsipcbuf;
+
+static int
+xrequest(envid_t fsenv, int type, void *dstva)
+{
+	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	return ipc_recv(NULL, dstva, NULL);
+}
+
+static void
+client(void)
+{
+	envid_t fsenv = ipc_find_env(ENV_TYPE_FS);
+	int i, r;
+
+	for (i = 0; i < NROUND; i++) {
+		strcpy(fsipcbuf.open.req_path, "/newmotd");
+		fsipcbuf.open.req_omode = O_RDONLY;
+		if ((r = xrequest(fsenv, FSREQ_OPEN, FVA)) < 0)
+			panic("serve_open /newmotd: %e", r);
+		if (FVA->fd_dev_id != 'f')
+			panic("serve_open did not fill struct Fd correctly");
+
+		fsipcbuf.stat.req_fileid = FVA->fd_file.id;
+		if ((r = xrequest(fsenv, FSREQ_STAT, NULL)) < 0)
+			panic("serve_stat: %e", r);
+		if (strcmp(fsipcbuf.statRet.ret_name, "newmotd") != 0)
+			panic("serve_stat returned name %s", fsipcbuf.statRet.ret_name);
+
+		// Dropping the Fd page closes the file
+		if ((r = sys_page_unmap(0, FVA)) < 0)
+			panic("sys_page_unmap: %e", r);
+	}
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child[NCHILD];
+	int i;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((child[i] = fork()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0)
+			client();
+	}
+	for (i = 0; i < NCHILD; i++)
+		wait(child[i]);
+	cprintf("fs send+recv is good\n");
+}
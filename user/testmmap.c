@@ -0,0 +1,48 @@
+#include <inc/lib.h>
+
+static char buf[3*PGSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	char *m;
+	int f, i, r;
+
+	// Read-only: the mapping matches what read() returns.
+	if ((f = open("/newmotd", O_RDONLY)) < 0)
+		panic("open /newmotd: %e", f);
+	if ((r = readn(f, buf, sizeof(buf))) <= 0)
+		panic("readn /newmotd: %e", r);
+	if ((m = mmap(f, 0, r, PROT_READ)) == NULL)
+		panic("mmap /newmotd failed");
+	if (memcmp(m, buf, r) != 0)
+		panic("mmap /newmotd returned wrong data");
+	if (mmap(f, 0, r, PROT_WRITE) != NULL)
+		panic("mmap /newmotd writable succeeded on read-only file");
+	if ((r = munmap(m)) < 0)
+		panic("munmap: %e", r);
+	close(f);
+	cprintf("mmap read is good\n");
+
+	// Writable: stores reach the file after msync.
+	if ((f = open("/mmapfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /mmapfile: %e", f);
+	memset(buf, 'a', sizeof(buf));
+	if ((r = write(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("write /mmapfile: %d %e", r, r);
+	if ((m = mmap(f, 0, sizeof(buf), PROT_READ|PROT_WRITE)) == NULL)
+		panic("mmap /mmapfile failed");
+	for (i = 0; i < sizeof(buf); i += 2*PGSIZE)
+		m[i] = 'b';
+	if ((r = msync(m, sizeof(buf))) < 0)
+		panic("msync: %e", r);
+	munmap(m);
+	seek(f, 0);
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf))
+		panic("readn /mmapfile: %d %e", r, r);
+	for (i = 0; i < sizeof(buf); i++)
+		if (buf[i] != (i % (2*PGSIZE) == 0 ? 'b' : 'a'))
+			panic("/mmapfile byte %d is %c after msync", i, buf[i]);
+	close(f);
+	cprintf("mmap write is good\n");
+}
@@ -0,0 +1,44 @@
+// Measure how fast the kernel hands out zeroed pages.
+//
+// Each sys_page_alloc zeroes a fresh page through the KERNBASE direct
+// map.  Build the kernel once as usual and once with DEFS=-DJOS_NO_PSE
+// to compare 4MB direct-map pages against 4K page tables.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NPAGES	64		// pages kept mapped per round
+#define NROUND	200
+
+static uint32_t
+measure(void)
+{
+	uint64_t start;
+	uint32_t cycles;
+	int i, j, r;
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		for (j = 0; j < NPAGES; j++)
+			if ((r = sys_page_alloc(0, UTEMP + j * PGSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+		for (j = 0; j < NPAGES; j++)
+			sys_page_unmap(0, UTEMP + j * PGSIZE);
+	}
+	cycles = read_tsc() - start;
+	return cycles / (NROUND * NPAGES);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t cycles;
+
+	// Warm up the page caches and page tables first.
+	measure();
+	cycles = measure();
+	cprintf("zerobench: %u cycles per zeroed page (alloc+unmap)\n", cycles);
+	cprintf("zerobench: %u bytes/Kcycle\n", PGSIZE * 1000 / cycles);
+	cprintf("zerobench: done\n");
+}